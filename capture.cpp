@@ -0,0 +1,186 @@
+/*
+ *	capture.cpp
+ *	Buffered, off-thread writer for traffic capture files.
+ */
+
+#include "capture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+CaptureWriter::CaptureWriter() : records(0), dropped(0), writeErrors(0), fd(-1),
+		started(false), stopping(false), current(-1), numFull(0), numFree(0), haveStart(false) {
+	for(int i = 0; i < NUM_BUFFERS; ++i) {
+		buffers[i].data = NULL;
+		buffers[i].used = 0;
+	}
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&wake, NULL);
+}
+
+CaptureWriter::~CaptureWriter() {
+	close();
+	for(int i = 0; i < NUM_BUFFERS; ++i) {
+		free(buffers[i].data);
+	}
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&wake);
+}
+
+bool CaptureWriter::open(const char * path) {
+	fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1) {
+		perror(path);
+		return false;
+	}
+	for(int i = 0; i < NUM_BUFFERS; ++i) {
+		buffers[i].data = (char *) malloc(BUFFER_SIZE);
+		freeList[numFree++] = i;
+	}
+	current = freeList[--numFree];
+	// The header is filled in (with the start time) by the first record.
+	buffers[current].used = sizeof(CaptureFileHeader);
+	if(pthread_create(&thread, NULL, writerMain, this) != 0) {
+		perror("starting capture writer");
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	started = true;
+	return true;
+}
+
+void CaptureWriter::record(const void * data, size_t len, const struct sockaddr_storage * from) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(!haveStart) {
+		// current is still the first buffer, with room kept for the header.
+		struct timespec wall;
+		clock_gettime(CLOCK_REALTIME, &wall);
+		CaptureFileHeader header;
+		header.cf_magic = CAPTURE_MAGIC;
+		header.cf_version = CAPTURE_VERSION;
+		header.cf_start_sec = wall.tv_sec;
+		header.cf_start_nsec = wall.tv_nsec;
+		memcpy(buffers[current].data, &header, sizeof(header));
+		start = now;
+		haveStart = true;
+	}
+
+	const size_t needed = sizeof(CaptureRecord) + len;
+	if(current != -1 && buffers[current].used + needed > BUFFER_SIZE) {
+		handOff();
+	}
+	if(current == -1) {
+		pthread_mutex_lock(&lock);
+		if(numFree > 0) {
+			current = freeList[--numFree];
+		}
+		pthread_mutex_unlock(&lock);
+		if(current == -1) {
+			++dropped;
+			return;
+		}
+	}
+
+	Buffer & b = buffers[current];
+	CaptureRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.rec_nanos = (uint64_t) (now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+	rec.rec_length = len;
+	rec.rec_family = from->ss_family;
+	if(from->ss_family == AF_INET) {
+		const struct sockaddr_in * in = (const struct sockaddr_in *) from;
+		rec.rec_port = in->sin_port;
+		memcpy(rec.rec_addr, &in->sin_addr, 4);
+	} else if(from->ss_family == AF_INET6) {
+		const struct sockaddr_in6 * in6 = (const struct sockaddr_in6 *) from;
+		rec.rec_port = in6->sin6_port;
+		memcpy(rec.rec_addr, &in6->sin6_addr, 16);
+	}
+	memcpy(b.data + b.used, &rec, sizeof(rec));
+	memcpy(b.data + b.used + sizeof(rec), data, len);
+	b.used += needed;
+	++records;
+}
+
+// Queues the current buffer for writing.  The next record picks up a free
+// one.
+void CaptureWriter::handOff() {
+	if(current == -1 || buffers[current].used == 0 || !haveStart) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	fullQueue[numFull++] = current;
+	current = numFree > 0 ? freeList[--numFree] : -1;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+}
+
+void CaptureWriter::flush() {
+	if(started) {
+		handOff();
+	}
+}
+
+void CaptureWriter::close() {
+	if(!started) {
+		return;
+	}
+	handOff();
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	::close(fd);
+	fd = -1;
+	started = false;
+}
+
+void * CaptureWriter::writerMain(void * arg) {
+	((CaptureWriter *) arg)->writeLoop();
+	return NULL;
+}
+
+void CaptureWriter::writeLoop() {
+	pthread_mutex_lock(&lock);
+	while(true) {
+		while(numFull == 0 && !stopping) {
+			pthread_cond_wait(&wake, &lock);
+		}
+		if(numFull == 0) {
+			break;
+		}
+		int index = fullQueue[0];
+		pthread_mutex_unlock(&lock);
+
+		Buffer & b = buffers[index];
+		size_t done = 0;
+		while(done < b.used) {
+			ssize_t n = write(fd, b.data + done, b.used - done);
+			if(n == -1) {
+				if(errno == EINTR) {
+					continue;
+				}
+				perror("writing capture");
+				++writeErrors;
+				break;
+			}
+			done += n;
+		}
+		b.used = 0;
+
+		pthread_mutex_lock(&lock);
+		--numFull;
+		memmove(fullQueue, fullQueue + 1, numFull * sizeof(int));
+		freeList[numFree++] = index;
+	}
+	pthread_mutex_unlock(&lock);
+}
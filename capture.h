@@ -0,0 +1,101 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/*
+ *	capture.h
+ *	Traffic capture files: every datagram the server received, with where it
+ *	came from and when, so a test build can be fed the same load later (see
+ *	replay.cpp).
+ *
+ *	A file is a CaptureFileHeader followed by records, each a CaptureRecord
+ *	immediately followed by rec_length bytes of datagram.  Everything is in
+ *	the byte order of the capturing host, which the magic number gives away.
+ *
+ *	CaptureWriter keeps disk I/O off the receive path: record() only copies
+ *	into an in-memory buffer, and full buffers are written out by a thread of
+ *	its own.  If the disk falls so far behind that no buffer is free, records
+ *	are dropped and counted rather than making the server wait.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+const uint32_t CAPTURE_MAGIC = 0x44434b31;	// "DCK1" when read big-endian
+const uint32_t CAPTURE_VERSION = 1;
+
+struct CaptureFileHeader {
+	uint32_t cf_magic;
+	uint32_t cf_version;
+	int64_t cf_start_sec;		// Wall clock time of the first record
+	int64_t cf_start_nsec;
+} __attribute__((__packed__));
+
+struct CaptureRecord {
+	uint64_t rec_nanos;			// Since the first record
+	uint16_t rec_length;
+	uint16_t rec_family;		// AF_INET or AF_INET6
+	uint16_t rec_port;			// Network byte order, as in the sockaddr
+	unsigned char rec_addr[16];	// IPv4 addresses use the first 4 bytes
+} __attribute__((__packed__));
+
+class CaptureWriter {
+public:
+	CaptureWriter();
+	~CaptureWriter();
+
+	// Creates (or truncates) path and starts the writer thread.  Returns
+	// false, after printing why, if that fails.
+	bool open(const char * path);
+
+	// Appends one datagram.  Only one thread may call this.
+	void record(const void * data, size_t len, const struct sockaddr_storage * from);
+
+	// Hands whatever is buffered to the writer thread, so an idle server's
+	// file doesn't lag behind indefinitely.
+	void flush();
+
+	// Flushes, waits for everything to reach the file and closes it.
+	void close();
+
+	unsigned long records;
+	unsigned long dropped;		// No buffer free; the writer fell behind
+	unsigned long writeErrors;
+
+private:
+	static const int NUM_BUFFERS = 4;
+	static const size_t BUFFER_SIZE = 1 << 20;
+
+	struct Buffer {
+		char * data;
+		size_t used;
+	};
+
+	int fd;
+	bool started;
+	bool stopping;
+	Buffer buffers[NUM_BUFFERS];
+	int current;				// Being filled by record(); -1 if none free
+	int fullQueue[NUM_BUFFERS];	// Waiting for the writer thread, oldest first
+	int numFull;
+	int freeList[NUM_BUFFERS];
+	int numFree;
+	bool haveStart;
+	struct timespec start;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;		// Writer: something to write or time to stop
+
+	void handOff();
+	static void * writerMain(void * arg);
+	void writeLoop();
+
+	CaptureWriter(const CaptureWriter &);
+	CaptureWriter & operator=(const CaptureWriter &);
+};
+
+#endif
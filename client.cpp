@@ -12,29 +12,53 @@
 #include <string.h>
 #include <algorithm>
 #include <iostream>
+#include <map>
 #include <set>
+#include <vector>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "duckchat.h"
+#include "scrollback.h"
 
 // ***** FUNCTION DECLARATIONS *****
 
 void restoreTerminal(void);
 void setupTerminal(void);
 void refreshAll(void);
+void scheduleRefresh(void);
+void renderFrame(void);
 void clearInput(void);
 
 void printErrorMsg(const char * msg);
 void printWarnMsg(const char * msg);
 
+void addLine(LineKind kind, const char * channel, const char * user, const char * text, size_t textMax);
+void drawLine(const ScrollbackLine & l);
+void redrawHistory(void);
+void pageUp(void);
+void pageDown(void);
+void updateStatus(void);
+
 bool handleInput(int sock, struct addrinfo * p);
+bool runCommand(int sock, struct addrinfo * p);
 
 void handleNetwork(int sock, struct addrinfo * p);
+void handlePacket(int sock, struct addrinfo * p, int recvSize);
+void handleMulticast(void);
+void joinGroup(int sock, struct addrinfo * p, const char * channelName, struct in_addr group, unsigned short port);
+void leaveGroup(const char * channelName);
+void waitForEvents(int sock, int idleTimeout);
 void sendLoginPacket(int sock, struct addrinfo * p, const char * userName);
 void sendLogoutPacket(int sock, struct addrinfo * p);
 void sendJoinPacket(int sock, struct addrinfo * p, const char * channelName);
@@ -42,17 +66,30 @@ void sendLeavePacket(int sock, struct addrinfo * p, const char * channelName);
 void sendSayPacket(int sock, struct addrinfo * p, const char * channelName, const char * msg);
 void sendListPacket(int sock, struct addrinfo * p);
 void sendWhoPacket(int sock, struct addrinfo * p, const char * channelName);
+void sendPresencePacket(int sock, struct addrinfo * p, const char * channelName, bool subscribe);
+void sendJoinManyPackets(int sock, struct addrinfo * p);
 void sendKeepAlivePacket(int sock, struct addrinfo * p);
+void sendMulticastAckPacket(int sock, struct addrinfo * p, const char * channelName, struct in_addr group);
+void beforeSend(int sock, struct addrinfo * p);
+static double secondsSince(const struct timespec * then);
 
 void timerExpired(int signum);
 
+int runRenderBenchmark(int count);
+int runHeadless(int sock, struct addrinfo * p, int inputFd, int linger);
+void writeField(const char * s, size_t max);
+
 // ***** CONSTANTS *****
 
-const int MAX_NUM_CHANNELS = 32;
-const int MAX_NUM_USERS = 32;
-const size_t MAX_BUFFER_SIZE = sizeof(text) + (CHANNEL_MAX*MAX_NUM_CHANNELS) + (USERNAME_MAX*MAX_NUM_USERS);
+const size_t MAX_BUFFER_SIZE = 65536;	// Server limits are configurable, so WHO and LIST can fill a datagram
 const int KEEP_ALIVE_FREQ = 60;
 const int MAXLINE = 64;
+const int DEFAULT_FRAME_RATE = 30;		// Max screen refreshes per second
+const int MAX_DRAIN_PER_FRAME = 1024;	// Datagrams handled between frame checks
+const int CLIENT_RCVBUF = 1 << 20;		// Socket buffer to absorb bursts between frames
+const int DEFAULT_SCROLLBACK_MB = 32;	// Memory cap for the message history
+const int DEFAULT_LINGER = 1;			// Seconds to wait for replies after headless input ends
+const int RESUME_IDLE = 20;				// Seconds of silence after which our NAT mapping may have changed
 
 // ***** GLOBAL VARIABLES *****
 
@@ -72,6 +109,40 @@ int sock = -1;			// Socket's file descriptor ID
 text * buf;				// Space to store incoming packets.
 bool timeForKeepAlive = false;
 std::set<std::string> channelsJoined;
+const char * loginName;	// Who we logged in as, for /reconnect
+
+// Resumption token from the server's TXT_SESSION.  Keep-alives carry it, so
+// if our address changes the session follows us instead of being lost.
+char sessionToken[SESSION_TOKEN_LEN];
+bool haveSessionToken = false;
+struct timespec lastSent;
+
+// Channels whose says the server sends to a multicast group, all received on
+// one socket bound to the server's multicast port.
+int mcastSock = -1;
+std::map<std::string, struct in_addr> multicastGroups;
+
+// Render scheduling: windows are only pushed to the terminal once per frame.
+int frameRate = DEFAULT_FRAME_RATE;
+bool refreshPending = false;
+struct timespec lastFrame;
+long framesDrawn = 0;
+
+// Message history and what part of it is on screen.  While following, new
+// lines are drawn as they arrive; otherwise the window shows the page of
+// matching lines that ends just before viewEnd.
+Scrollback * history;
+ScrollbackFilter viewFilter;
+bool following = true;
+uint64_t viewEnd = 0;
+
+// Headless mode: commands come from stdin or a script, received packets are
+// written to stdout as records, and curses is never started.
+bool headless = false;
+
+// Render benchmark bookkeeping (only used with -b).
+bool benchMode = false;
+long benchReceived = 0;
 
 // Apparently Solaris doesn't have strnlen built in.
 static inline size_t strnlen(const char *s, size_t max) {
@@ -81,14 +152,68 @@ static inline size_t strnlen(const char *s, size_t max) {
 }
 
 int main(int argc, char ** argv) {
-    if(argc != 4) {
-        std::cerr << "usage: " << argv[0] << " server_name port user_name" << std::endl;
+    int benchCount = 0;
+    int scrollbackMB = DEFAULT_SCROLLBACK_MB;
+    const char * scriptName = NULL;
+    int linger = DEFAULT_LINGER;
+    int opt;
+    while((opt = getopt(argc, argv, "r:b:m:Hs:w:")) != -1) {
+        switch(opt) {
+            case 'H':
+                headless = true;
+                break;
+            case 's':
+                headless = true;
+                scriptName = optarg;
+                break;
+            case 'w':
+                linger = atoi(optarg);
+                break;
+            case 'r':
+                frameRate = atoi(optarg);
+                break;
+            case 'm':
+                scrollbackMB = atoi(optarg);
+                break;
+            case 'b':
+                benchCount = atoi(optarg);
+                break;
+            default:
+                std::cerr << "usage: " << argv[0] << " [-r frame_rate] [-m scrollback_mb] server_name port user_name" << std::endl;
+                std::cerr << "       " << argv[0] << " -H | -s script_file [-w linger_secs] server_name port user_name" << std::endl;
+                std::cerr << "       " << argv[0] << " [-r frame_rate] -b message_count" << std::endl;
+                exit(-1);
+        }
+    }
+    if(frameRate <= 0) {
+        std::cerr << "error: frame rate must be positive" << std::endl;
+        exit(-1);
+    }
+    if(scrollbackMB <= 0) {
+        std::cerr << "error: scrollback size must be positive" << std::endl;
         exit(-1);
     }
-    char * hostName = argv[1];
-    int portNum = atoi(argv[2]);
-    char * portNumStr = argv[2];
-    char * userName = argv[3];
+    history = new Scrollback((size_t) scrollbackMB << 20);
+    int inputFd = STDIN_FILENO;
+    if(scriptName != NULL) {
+        inputFd = open(scriptName, O_RDONLY);
+        if(inputFd == -1) {
+            perror(scriptName);
+            exit(-1);
+        }
+    }
+    if(benchCount > 0) {
+        return runRenderBenchmark(benchCount);
+    }
+
+    if(argc - optind != 3) {
+        std::cerr << "usage: " << argv[0] << " [-r frame_rate] [-m scrollback_mb] server_name port user_name" << std::endl;
+        exit(-1);
+    }
+    char * hostName = argv[optind];
+    int portNum = atoi(argv[optind+1]);
+    char * portNumStr = argv[optind+1];
+    char * userName = argv[optind+2];
 
     if(portNum < 0 || portNum > 65535) {
         std::cerr << "error: port number must be between 0 and 65535" << std::endl;
@@ -133,10 +258,25 @@ int main(int argc, char ** argv) {
 	
 	buf = (text *) malloc(MAX_BUFFER_SIZE);
 
-    fcntl(sock, F_SETFL, O_NONBLOCK);
+	// Receives never block (handleNetwork uses MSG_DONTWAIT).  Headless sends
+	// are allowed to block so a fast script is throttled rather than dropped.
+	if(!headless) {
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+	}
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &CLIENT_RCVBUF, sizeof(CLIENT_RCVBUF));
 
+    loginName = userName;
     sendLoginPacket(sock, p, userName);
     sendJoinPacket(sock, p, "Common");
+    channelsJoined.insert("Common");
+
+    if(headless) {
+        int result = runHeadless(sock, p, inputFd, linger);
+        sendLogoutPacket(sock, p);
+        close(sock);
+        free(buf);
+        return result;
+    }
 
     atexit(restoreTerminal);
     setupTerminal();
@@ -150,7 +290,17 @@ int main(int argc, char ** argv) {
 	signal(SIGALRM, timerExpired);
 	alarm(KEEP_ALIVE_FREQ);
 
-    while(handleInput(sock, p)) {
+    while(true) {
+		waitForEvents(sock, -1);
+		if(timeForKeepAlive) {
+			sendKeepAlivePacket(sock, p);
+			timeForKeepAlive = false;
+		}
+		handleNetwork(sock, p);
+		if(!handleInput(sock, p)) {
+			break;
+		}
+		renderFrame();
     }
 
     sendLogoutPacket(sock, p);
@@ -163,6 +313,8 @@ int main(int argc, char ** argv) {
 
 void sendLoginPacket(int sock, struct addrinfo * p, const char * userName) {
 	alarm(KEEP_ALIVE_FREQ);
+	clock_gettime(CLOCK_MONOTONIC, &lastSent);
+	haveSessionToken = false;
     struct request_login packet;
 	memset(&packet, '\0', sizeof(packet));
     packet.req_type = htonl(REQ_LOGIN);
@@ -175,7 +327,7 @@ void sendLoginPacket(int sock, struct addrinfo * p, const char * userName) {
 }
 
 void sendLogoutPacket(int sock, struct addrinfo * p) {
-	alarm(KEEP_ALIVE_FREQ);
+	beforeSend(sock, p);
     struct request_logout packet;
 	memset(&packet, '\0', sizeof(packet));
     packet.req_type = htonl(REQ_LOGOUT);
@@ -186,7 +338,7 @@ void sendLogoutPacket(int sock, struct addrinfo * p) {
 }
 
 void sendJoinPacket(int sock, struct addrinfo * p, const char * channelName) {
-	alarm(KEEP_ALIVE_FREQ);
+	beforeSend(sock, p);
     struct request_join packet;
 	memset(&packet, '\0', sizeof(packet));
     packet.req_type = htonl(REQ_JOIN);
@@ -198,7 +350,7 @@ void sendJoinPacket(int sock, struct addrinfo * p, const char * channelName) {
 }
 
 void sendLeavePacket(int sock, struct addrinfo * p, const char * channelName) {
-	alarm(KEEP_ALIVE_FREQ);
+	beforeSend(sock, p);
     struct request_leave packet;
     packet.req_type = htonl(REQ_LEAVE);
     strncpy(packet.req_channel, channelName, CHANNEL_MAX);
@@ -209,7 +361,7 @@ void sendLeavePacket(int sock, struct addrinfo * p, const char * channelName) {
 }
 
 void sendSayPacket(int sock, struct addrinfo * p, const char * channelName, const char * msg) {
-	alarm(KEEP_ALIVE_FREQ);
+	beforeSend(sock, p);
     struct request_say packet;
 	memset(&packet, '\0', sizeof(packet));
     packet.req_type = htonl(REQ_SAY);
@@ -222,7 +374,7 @@ void sendSayPacket(int sock, struct addrinfo * p, const char * channelName, cons
 }
 
 void sendListPacket(int sock, struct addrinfo * p) {
-	alarm(KEEP_ALIVE_FREQ);
+	beforeSend(sock, p);
     struct request_list packet;
 	memset(&packet, '\0', sizeof(packet));
     packet.req_type = htonl(REQ_LIST);
@@ -233,7 +385,7 @@ void sendListPacket(int sock, struct addrinfo * p) {
 }
 
 void sendWhoPacket(int sock, struct addrinfo * p, const char * channelName) {
-	alarm(KEEP_ALIVE_FREQ);
+	beforeSend(sock, p);
     struct request_who packet;
 	memset(&packet, '\0', sizeof(packet));
     packet.req_type = htonl(REQ_WHO);
@@ -244,22 +396,190 @@ void sendWhoPacket(int sock, struct addrinfo * p, const char * channelName) {
     }
 }
 
+void sendPresencePacket(int sock, struct addrinfo * p, const char * channelName, bool subscribe) {
+	beforeSend(sock, p);
+    struct request_presence packet;
+	memset(&packet, '\0', sizeof(packet));
+    packet.req_type = htonl(REQ_PRESENCE);
+    packet.req_subscribe = htonl(subscribe ? 1 : 0);
+    strncpy(packet.req_channel, channelName, CHANNEL_MAX);
+    int status = sendto(sock, &packet, sizeof(struct request_presence), 0, p->ai_addr, p->ai_addrlen);
+    if(status == -1) {
+		printErrorMsg("unable to send presence packet");
+    }
+}
+
+// Rejoins every channel in channelsJoined with as few REQ_JOIN_MANY packets
+// as the server allows.
+void sendJoinManyPackets(int sock, struct addrinfo * p) {
+	beforeSend(sock, p);
+	const size_t maxSize = sizeof(request_join_many) + (JOIN_MANY_MAX * CHANNEL_MAX);
+	request_join_many * packet = (request_join_many *) malloc(maxSize);
+	std::set<std::string>::const_iterator it = channelsJoined.begin();
+	while(it != channelsJoined.end()) {
+		memset(packet, '\0', maxSize);
+		packet->req_type = htonl(REQ_JOIN_MANY);
+		int n = 0;
+		for(; it != channelsJoined.end() && n < JOIN_MANY_MAX; ++it, ++n) {
+			strncpy(packet->req_channels[n], it->c_str(), CHANNEL_MAX);
+		}
+		packet->req_nchannels = htonl(n);
+		int status = sendto(sock, packet, sizeof(request_join_many) + (n * CHANNEL_MAX), 0, p->ai_addr, p->ai_addrlen);
+		if(status == -1) {
+			printErrorMsg("unable to send multi-join packet");
+		}
+	}
+	free(packet);
+}
+
+void sendMulticastAckPacket(int sock, struct addrinfo * p, const char * channelName, struct in_addr group) {
+	beforeSend(sock, p);
+    struct request_multicast_ack packet;
+	memset(&packet, '\0', sizeof(packet));
+    packet.req_type = htonl(REQ_MULTICAST_ACK);
+    strncpy(packet.req_channel, channelName, CHANNEL_MAX);
+    packet.req_group = group.s_addr;
+    int status = sendto(sock, &packet, sizeof(struct request_multicast_ack), 0, p->ai_addr, p->ai_addrlen);
+    if(status == -1) {
+		printErrorMsg("unable to send multicast ack packet");
+    }
+}
+
 void sendKeepAlivePacket(int sock, struct addrinfo * p) {
-    struct request_keep_alive packet;
+	clock_gettime(CLOCK_MONOTONIC, &lastSent);
+    struct request_keep_alive_token packet;
 	memset(&packet, '\0', sizeof(packet));
     packet.req_type = htonl(REQ_KEEP_ALIVE);
-    int status = sendto(sock, &packet, sizeof(struct request_keep_alive), 0, p->ai_addr, p->ai_addrlen);
+    size_t len = sizeof(struct request_keep_alive);
+    if(haveSessionToken) {
+        memcpy(packet.req_token, sessionToken, SESSION_TOKEN_LEN);
+        len = sizeof(struct request_keep_alive_token);
+    }
+    int status = sendto(sock, &packet, len, 0, p->ai_addr, p->ai_addrlen);
     if(status == -1) {
 		printErrorMsg("unable to send keep-alive packet");
     }
 }
 
+// Called before every request.  After a long silence the NAT in front of us
+// may have given us a new port, which the server wouldn't recognise, so a
+// keep-alive with the token goes first to move the session over.
+void beforeSend(int sock, struct addrinfo * p) {
+	if(haveSessionToken && secondsSince(&lastSent) >= RESUME_IDLE) {
+		sendKeepAlivePacket(sock, p);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &lastSent);
+	alarm(KEEP_ALIVE_FREQ);
+}
+
+// Drains every datagram waiting on the socket (up to MAX_DRAIN_PER_FRAME, so
+// input and rendering still get a turn during a flood).  Packets are written
+// into the windows but not pushed to the terminal; see renderFrame().
 void handleNetwork(int sock, struct addrinfo * p) {
 	struct sockaddr_storage fromAddr;
-	socklen_t fromAddrLen = sizeof(fromAddr);
-	int recvSize = recvfrom(sock, buf, MAX_BUFFER_SIZE, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
-	if(recvSize > 0) {
-		
+	for(int i = 0; i < MAX_DRAIN_PER_FRAME; ++i) {
+		socklen_t fromAddrLen = sizeof(fromAddr);
+		int recvSize = recvfrom(sock, buf, MAX_BUFFER_SIZE, MSG_DONTWAIT, (struct sockaddr *)&fromAddr, &fromAddrLen);
+		if(recvSize <= 0) {
+			break;
+		}
+		handlePacket(sock, p, recvSize);
+	}
+	handleMulticast();
+}
+
+// Says that arrived by multicast.  Only channels we were told to expect
+// there are shown; anything else on the port is for some other client on
+// this host.
+void handleMulticast(void) {
+	if(mcastSock == -1) {
+		return;
+	}
+	for(int i = 0; i < MAX_DRAIN_PER_FRAME; ++i) {
+		int recvSize = recv(mcastSock, buf, MAX_BUFFER_SIZE, MSG_DONTWAIT);
+		if(recvSize <= 0) {
+			break;
+		}
+		if(recvSize < sizeof(text_say) || ntohl(buf->txt_type) != TXT_SAY) {
+			continue;
+		}
+		text_say * pkt = (text_say *) buf;
+		char chanName[CHANNEL_MAX+1];
+		memset(chanName, '\0', CHANNEL_MAX+1);
+		strncpy(chanName, pkt->txt_channel, CHANNEL_MAX);
+		if(multicastGroups.count(chanName) > 0) {
+			handlePacket(-1, NULL, recvSize);
+		}
+	}
+}
+
+// Starts receiving a channel's says from its group, on the interface we
+// reach the server through, and tells the server it can stop sending them
+// to us directly.  If anything fails we simply stay on unicast.
+void joinGroup(int sock, struct addrinfo * p, const char * channelName, struct in_addr group, unsigned short port) {
+	leaveGroup(channelName);
+	if(group.s_addr == 0 || p == NULL || p->ai_family != AF_INET) {
+		return;
+	}
+	if(mcastSock == -1) {
+		mcastSock = socket(AF_INET, SOCK_DGRAM, 0);
+		int on = 1;
+		setsockopt(mcastSock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef IP_MULTICAST_ALL
+		// Only the groups joined on this socket, not every group on the host.
+		int off = 0;
+		setsockopt(mcastSock, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+#endif
+		setsockopt(mcastSock, SOL_SOCKET, SO_RCVBUF, &CLIENT_RCVBUF, sizeof(CLIENT_RCVBUF));
+		struct sockaddr_in local;
+		memset(&local, 0, sizeof(local));
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+		local.sin_port = port;
+		if(bind(mcastSock, (struct sockaddr *) &local, sizeof(local)) == -1) {
+			printWarnMsg("unable to bind multicast socket; staying on unicast");
+			close(mcastSock);
+			mcastSock = -1;
+			return;
+		}
+	}
+	// Our own socket isn't connected, so ask the kernel which local address
+	// a connected one would use to reach the server.
+	struct ip_mreq mreq;
+	mreq.imr_multiaddr = group;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	int probe = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in bound;
+	socklen_t boundLen = sizeof(bound);
+	if(probe != -1 && connect(probe, p->ai_addr, p->ai_addrlen) == 0 &&
+			getsockname(probe, (struct sockaddr *) &bound, &boundLen) == 0) {
+		mreq.imr_interface = bound.sin_addr;
+	}
+	if(probe != -1) {
+		close(probe);
+	}
+	if(setsockopt(mcastSock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1) {
+		printWarnMsg("unable to join multicast group; staying on unicast");
+		return;
+	}
+	multicastGroups[channelName] = group;
+	sendMulticastAckPacket(sock, p, channelName, group);
+}
+
+void leaveGroup(const char * channelName) {
+	std::map<std::string, struct in_addr>::iterator it = multicastGroups.find(channelName);
+	if(it == multicastGroups.end()) {
+		return;
+	}
+	struct ip_mreq mreq;
+	mreq.imr_multiaddr = it->second;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	multicastGroups.erase(it);
+	// Two channels never share a group, so the membership can go.
+	setsockopt(mcastSock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+}
+
+void handlePacket(int sock, struct addrinfo * p, int recvSize) {
 		if(recvSize >= sizeof(text)) {
 			buf->txt_type = ntohl(buf->txt_type);
 			switch(buf->txt_type) {
@@ -267,16 +587,20 @@ void handleNetwork(int sock, struct addrinfo * p) {
 				case TXT_SAY:
 					if(recvSize >= sizeof(text_say)) {
 						text_say * pkt = (text_say *) buf;
-						wprintw(wnd, "[");
-						wattron(wnd, COLOR_PAIR(3));
-						wprintw(wnd, "%.32s", pkt->txt_channel);
-						wattroff(wnd, COLOR_PAIR(3));
-						wprintw(wnd, "][");
-						wattron(wnd, COLOR_PAIR(4));
-						wprintw(wnd, "%.32s", pkt->txt_username);
-						wattroff(wnd, COLOR_PAIR(4));
-						wprintw(wnd, "]: %.64s\n", pkt->txt_text);
-						refreshAll();
+						if(headless) {
+							fputs("SAY\t", stdout);
+							writeField(pkt->txt_channel, CHANNEL_MAX);
+							putchar('\t');
+							writeField(pkt->txt_username, USERNAME_MAX);
+							putchar('\t');
+							writeField(pkt->txt_text, SAY_MAX);
+							putchar('\n');
+							break;
+						}
+						addLine(LINE_SAY, pkt->txt_channel, pkt->txt_username, pkt->txt_text, SAY_MAX);
+						if(benchMode) {
+							++benchReceived;
+						}
 					} else {
 						char err[256];
 						snprintf(err, 256, "say packet should be at least %d bytes, but got %d", sizeof(text_say), recvSize);
@@ -287,6 +611,12 @@ void handleNetwork(int sock, struct addrinfo * p) {
 				case TXT_ERROR:
 					if(recvSize >= sizeof(text_error)) {
 						text_error * pkt = (text_error *) buf;
+						if(headless) {
+							fputs("ERROR\t", stdout);
+							writeField(pkt->txt_error, SAY_MAX);
+							putchar('\n');
+							break;
+						}
 						char say[SAY_MAX+1];
 						strncpy(say, pkt->txt_error, SAY_MAX);
 						say[SAY_MAX] = '\0';
@@ -304,16 +634,18 @@ void handleNetwork(int sock, struct addrinfo * p) {
 						pkt->txt_nchannels = htonl(pkt->txt_nchannels);
 						const size_t expectedSize = sizeof(text_list) + 
 													(pkt->txt_nchannels * sizeof(channel_info));
-						if(recvSize >= expectedSize) {
-							wattron(wnd, A_BOLD);
-							wprintw(wnd, "Existing channels:\n");
-							wattroff(wnd, A_BOLD);
+						if(recvSize >= expectedSize && headless) {
+							printf("LIST\t%d", pkt->txt_nchannels);
+							for(int i = 0; i < pkt->txt_nchannels; ++i) {
+								putchar('\t');
+								writeField(pkt->txt_channels[i].ch_channel, CHANNEL_MAX);
+							}
+							putchar('\n');
+						} else if(recvSize >= expectedSize) {
+							addLine(LINE_LIST_HEADER, NULL, NULL, NULL, 0);
 							for(int i = 0; i < pkt->txt_nchannels; ++i) {
-								wattron(wnd, COLOR_PAIR(3));
-								wprintw(wnd, "\t%.32s\n", pkt->txt_channels[i].ch_channel);
-								wattroff(wnd, COLOR_PAIR(3));
+								addLine(LINE_CHANNEL, pkt->txt_channels[i].ch_channel, NULL, NULL, 0);
 							}
-							refreshAll();
 						} else {
 							char err[256];
 							snprintf(err, 256, "list packet should be at least %d bytes, but got %d", expectedSize, recvSize);
@@ -333,20 +665,20 @@ void handleNetwork(int sock, struct addrinfo * p) {
 						pkt->txt_nusernames = htonl(pkt->txt_nusernames);
 						const size_t expectedSize = sizeof(text_who) + 
 													(pkt->txt_nusernames * sizeof(user_info));
-						if(recvSize >= expectedSize) {
-							wattron(wnd, A_BOLD);
-							wprintw(wnd, "Users on channel ");
-							wattron(wnd, COLOR_PAIR(3));
-							wprintw(wnd, "%.32s", pkt->txt_channel);
-							wattroff(wnd, COLOR_PAIR(3));
-							wprintw(wnd, ":\n");
-							wattroff(wnd, A_BOLD);
+						if(recvSize >= expectedSize && headless) {
+							fputs("WHO\t", stdout);
+							writeField(pkt->txt_channel, CHANNEL_MAX);
+							printf("\t%d", pkt->txt_nusernames);
 							for(int i = 0; i < pkt->txt_nusernames; ++i) {
-								wattron(wnd, COLOR_PAIR(4));
-								wprintw(wnd, "\t%.32s\n", pkt->txt_users[i].us_username);
-								wattroff(wnd, COLOR_PAIR(4));
+								putchar('\t');
+								writeField(pkt->txt_users[i].us_username, USERNAME_MAX);
+							}
+							putchar('\n');
+						} else if(recvSize >= expectedSize) {
+							addLine(LINE_WHO_HEADER, pkt->txt_channel, NULL, NULL, 0);
+							for(int i = 0; i < pkt->txt_nusernames; ++i) {
+								addLine(LINE_USER, NULL, pkt->txt_users[i].us_username, NULL, 0);
 							}
-							refreshAll();
 						} else {
 							char err[256];
 							snprintf(err, 256, "list packet should be at least %d bytes, but got %d", expectedSize, recvSize);
@@ -360,6 +692,125 @@ void handleNetwork(int sock, struct addrinfo * p) {
 					}
 					break;
 
+				case TXT_SESSION:
+					if(recvSize >= sizeof(text_session)) {
+						text_session * pkt = (text_session *)buf;
+						memcpy(sessionToken, pkt->txt_token, SESSION_TOKEN_LEN);
+						haveSessionToken = true;
+					} else {
+						char err[256];
+						snprintf(err, 256, "session packet should be at least %d bytes, but got %d", sizeof(text_session), recvSize);
+						printWarnMsg(err);
+					}
+					break;
+
+				case TXT_JOIN_RESULT:
+					if(recvSize >= sizeof(text_join_result)) {
+						text_join_result * pkt = (text_join_result *)buf;
+						pkt->txt_nresults = ntohl(pkt->txt_nresults);
+						const size_t expectedSize = sizeof(text_join_result) +
+													(pkt->txt_nresults * sizeof(join_result));
+						if(recvSize < expectedSize) {
+							char err[256];
+							snprintf(err, 256, "join result packet should be at least %d bytes, but got %d", expectedSize, recvSize);
+							printWarnMsg(err);
+							break;
+						}
+						if(headless) {
+							printf("JOIN\t%d", pkt->txt_nresults);
+						}
+						for(int i = 0; i < pkt->txt_nresults; ++i) {
+							char chanName[CHANNEL_MAX+1];
+							memset(chanName, '\0', CHANNEL_MAX+1);
+							strncpy(chanName, pkt->txt_results[i].jr_channel, CHANNEL_MAX);
+							int status = ntohl(pkt->txt_results[i].jr_status);
+							if(headless) {
+								static const char * const statusNames[] = { "ok", "already", "full", "too_many" };
+								putchar('\t');
+								writeField(chanName, CHANNEL_MAX);
+								putchar('\t');
+								fputs(status >= 0 && status <= JOIN_TOO_MANY_CHANNELS ? statusNames[status] : "unknown", stdout);
+							}
+							if(status == JOIN_OK || status == JOIN_ALREADY_MEMBER) {
+								continue;
+							}
+							// We thought we were in it; now we're not.
+							channelsJoined.erase(chanName);
+							if(strncmp(curChannel, chanName, CHANNEL_MAX) == 0) {
+								memset(curChannel, '\0', CHANNEL_MAX);
+							}
+							if(!headless) {
+								char err[256];
+								snprintf(err, 256, "could not rejoin channel %.32s: %s", chanName,
+										status == JOIN_CHANNEL_FULL ? "channel is full" : "too many channels");
+								printErrorMsg(err);
+							}
+						}
+						if(headless) {
+							putchar('\n');
+						}
+					} else {
+						char err[256];
+						snprintf(err, 256, "join result packet should be at least %d bytes, but got %d", sizeof(text_join_result), recvSize);
+						printWarnMsg(err);
+					}
+					break;
+
+				case TXT_MULTICAST:
+					if(recvSize >= sizeof(text_multicast) && p != NULL) {
+						text_multicast * pkt = (text_multicast *)buf;
+						char chanName[CHANNEL_MAX+1];
+						memset(chanName, '\0', CHANNEL_MAX+1);
+						strncpy(chanName, pkt->txt_channel, CHANNEL_MAX);
+						struct in_addr group;
+						group.s_addr = pkt->txt_group;
+						joinGroup(sock, p, chanName, group, pkt->txt_port);
+						if(headless) {
+							fputs("MULTICAST\t", stdout);
+							writeField(chanName, CHANNEL_MAX);
+							printf("\t%s\t%s\n", group.s_addr == 0 ? "-" : inet_ntoa(group),
+									multicastGroups.count(chanName) > 0 ? "joined" : "unicast");
+						}
+					} else if(recvSize < sizeof(text_multicast)) {
+						char err[256];
+						snprintf(err, 256, "multicast packet should be at least %d bytes, but got %d", sizeof(text_multicast), recvSize);
+						printWarnMsg(err);
+					}
+					break;
+
+				case TXT_PRESENCE:
+					if(recvSize >= sizeof(text_presence)) {
+						text_presence * pkt = (text_presence *)buf;
+						pkt->txt_nchanges = ntohl(pkt->txt_nchanges);
+						const size_t expectedSize = sizeof(text_presence) +
+													(pkt->txt_nchanges * sizeof(presence_change));
+						if(recvSize >= expectedSize && headless) {
+							fputs("PRESENCE\t", stdout);
+							writeField(pkt->txt_channel, CHANNEL_MAX);
+							printf("\t%d", pkt->txt_nchanges);
+							for(int i = 0; i < pkt->txt_nchanges; ++i) {
+								putchar('\t');
+								putchar(ntohl(pkt->txt_changes[i].pc_joined) ? '+' : '-');
+								writeField(pkt->txt_changes[i].pc_username, USERNAME_MAX);
+							}
+							putchar('\n');
+						} else if(recvSize >= expectedSize) {
+							for(int i = 0; i < pkt->txt_nchanges; ++i) {
+								addLine(ntohl(pkt->txt_changes[i].pc_joined) ? LINE_JOINED : LINE_LEFT,
+										pkt->txt_channel, pkt->txt_changes[i].pc_username, NULL, 0);
+							}
+						} else {
+							char err[256];
+							snprintf(err, 256, "presence packet should be at least %d bytes, but got %d", expectedSize, recvSize);
+							printWarnMsg(err);
+						}
+					} else {
+						char err[256];
+						snprintf(err, 256, "presence packet should be at least %d bytes, but got %d", sizeof(text_presence), recvSize);
+						printWarnMsg(err);
+					}
+					break;
+
 				
 				default:
 					char err[256];
@@ -372,89 +823,306 @@ void handleNetwork(int sock, struct addrinfo * p) {
 			snprintf(err, 256, "expected at least %d bytes, but got %d", sizeof(text), recvSize);
 			printWarnMsg(err);
 		}
-		
-	}
 }
 
+// Consumes every key that is waiting.  Returns false once the user asks to exit.
 bool handleInput(int sock, struct addrinfo * p) {
     int charRead;
     while(true)  {
-		if(timeForKeepAlive) {
-			sendKeepAlivePacket(sock, p);
-			timeForKeepAlive = false;
-		}
-		handleNetwork(sock, p);
         charRead = wgetch(inputWnd);        
-        if(charRead == 127 && nchars > 0) {
+        if(charRead == ERR) {
+            return true;
+        } else if(charRead == KEY_PPAGE) {
+            pageUp();
+        } else if(charRead == KEY_NPAGE) {
+            pageDown();
+        } else if(charRead == KEY_END) {
+            following = true;
+            redrawHistory();
+        } else if(charRead == 127 && nchars > 0) {
             int cy, cx;
             getyx(inputWnd, cy, cx);
             mvwaddch(inputWnd, cy, cx-1, ' ');
 			wmove(inputWnd, cy, cx-1);
             line[nchars] = '\0';
             --nchars;
-            return true;
+            scheduleRefresh();
         } else if(charRead >= 32 && charRead <= 126 && nchars < MAXLINE) {
-            wechochar(inputWnd, charRead);
+            waddch(inputWnd, charRead);
             line[nchars] = charRead;
-            refreshAll();
+            scheduleRefresh();
             ++nchars;
-            return true;
         } else if(charRead == '\n') {
-            if(strncmp(line, "/exit", std::max(nchars, MAXLINE+1)) == 0) {
+            if(!runCommand(sock, p)) {
                 return false;
-            } else if(strncmp(line, "/join ", 6) == 0) {
-                sendJoinPacket(sock, p, &(line[6]));
-				memset(curChannel, '\0', CHANNEL_MAX+1);
-				strncpy(curChannel, &(line[6]), CHANNEL_MAX);
-				channelsJoined.insert(curChannel);
-			} else if(strncmp(line, "/switch ", 8) == 0) {
-				char chanName[CHANNEL_MAX+1];
-				memset(chanName, '\0', CHANNEL_MAX+1);
-				strncpy(chanName, &(line[8]), CHANNEL_MAX);
-				if(channelsJoined.count(chanName) > 0) {
-					strncpy(curChannel, chanName, CHANNEL_MAX);
-				} else {
-					char err[256];
-					snprintf(err, 256, "you have not subscribed to channel %.32s", chanName);
-					printErrorMsg(err);
-				}
-            } else if(strncmp(line, "/leave ", 7) == 0) {
-                sendLeavePacket(sock, p, &(line[7]));
-				memset(curChannel, '\0', CHANNEL_MAX+1);
-				strncpy(curChannel, &(line[7]), CHANNEL_MAX);
-				channelsJoined.erase(curChannel);
-				memset(curChannel, '\0', CHANNEL_MAX);
-			} else if(strncmp(line, "/list", 5) == 0) {
-				sendListPacket(sock, p);
-			} else if(strncmp(line, "/who ", 5) == 0) {
-				sendWhoPacket(sock, p, &(line[5]));
-            } else if(line[0] == '/') {
-				printErrorMsg("unrecognized command");
-			} else if(curChannel[0] != '\0'){
-				sendSayPacket(sock, p, curChannel, line);
-			}
+            }
             //wprintw(wnd, "%s\n", line);
             memset(line, '\0', MAXLINE+1);
             clearInput();
-            return true;
         }
     };
 }
 
+// Acts on the command or chat message in line.  Shared by the terminal and
+// headless frontends.  Returns false if the user asked to exit.
+bool runCommand(int sock, struct addrinfo * p) {
+    if(strncmp(line, "/exit", std::max(nchars, MAXLINE+1)) == 0) {
+        return false;
+    } else if(strncmp(line, "/join ", 6) == 0) {
+        sendJoinPacket(sock, p, &(line[6]));
+		memset(curChannel, '\0', CHANNEL_MAX+1);
+		strncpy(curChannel, &(line[6]), CHANNEL_MAX);
+		channelsJoined.insert(curChannel);
+	} else if(strncmp(line, "/switch ", 8) == 0) {
+		char chanName[CHANNEL_MAX+1];
+		memset(chanName, '\0', CHANNEL_MAX+1);
+		strncpy(chanName, &(line[8]), CHANNEL_MAX);
+		if(channelsJoined.count(chanName) > 0) {
+			strncpy(curChannel, chanName, CHANNEL_MAX);
+		} else {
+			char err[256];
+			snprintf(err, 256, "you have not subscribed to channel %.32s", chanName);
+			printErrorMsg(err);
+		}
+    } else if(strncmp(line, "/leave ", 7) == 0) {
+        sendLeavePacket(sock, p, &(line[7]));
+		memset(curChannel, '\0', CHANNEL_MAX+1);
+		strncpy(curChannel, &(line[7]), CHANNEL_MAX);
+		channelsJoined.erase(curChannel);
+		leaveGroup(curChannel);
+		memset(curChannel, '\0', CHANNEL_MAX);
+	} else if(strncmp(line, "/list", 5) == 0) {
+		sendListPacket(sock, p);
+	} else if(strncmp(line, "/who ", 5) == 0) {
+		sendWhoPacket(sock, p, &(line[5]));
+	} else if(strncmp(line, "/reconnect", std::max(nchars, MAXLINE+1)) == 0) {
+		// A fresh login drops whatever the server still had for us; then
+		// every channel comes back in one or two bulk joins.
+		sendLoginPacket(sock, p, loginName);
+		sendJoinManyPackets(sock, p);
+	} else if(strncmp(line, "/watch ", 7) == 0) {
+		sendPresencePacket(sock, p, &(line[7]), true);
+	} else if(strncmp(line, "/unwatch ", 9) == 0) {
+		sendPresencePacket(sock, p, &(line[9]), false);
+	} else if(strncmp(line, "/say ", 5) == 0) {
+		char chanName[CHANNEL_MAX+1];
+		memset(chanName, '\0', CHANNEL_MAX+1);
+		const char * msg = strchr(&(line[5]), ' ');
+		if(msg == NULL) {
+			printErrorMsg("usage: /say channel message");
+		} else {
+			strncpy(chanName, &(line[5]), std::min((size_t) (msg - &(line[5])), (size_t) CHANNEL_MAX));
+			sendSayPacket(sock, p, chanName, msg + 1);
+		}
+	} else if(!headless && strncmp(line, "/search", 7) == 0 && (line[7] == ' ' || line[7] == '\0')) {
+		viewFilter.substring = line[7] == '\0' ? "" : &(line[8]);
+		following = true;
+		redrawHistory();
+	} else if(!headless && strncmp(line, "/filter", 7) == 0 && (line[7] == ' ' || line[7] == '\0')) {
+		if(line[7] == '\0') {
+			viewFilter.channel = Scrollback::NO_NAME;
+		} else {
+			viewFilter.channel = history->intern(&(line[8]), CHANNEL_MAX);
+		}
+		following = true;
+		redrawHistory();
+    } else if(line[0] == '/') {
+		printErrorMsg("unrecognized command");
+	} else if(curChannel[0] != '\0'){
+		sendSayPacket(sock, p, curChannel, line);
+	}
+    return true;
+}
+
 void printErrorMsg(const char * msg) {
-	wattron(wnd, COLOR_PAIR(1));
-	wprintw(wnd, "Error: ");
-	wattroff(wnd, COLOR_PAIR(1));
-	wprintw(wnd, "%s\n", msg);
-	refreshAll();
+	if(headless) {
+		fprintf(stderr, "error: %s\n", msg);
+		return;
+	}
+	addLine(LINE_ERROR, NULL, NULL, msg, Scrollback::MAX_TEXT);
 }
 
 void printWarnMsg(const char * msg) {
-	wattron(wnd, COLOR_PAIR(2));
-	wprintw(wnd, "Warning: ");
-	wattroff(wnd, COLOR_PAIR(2));
-	wprintw(wnd, "%s\n", msg);
-	refreshAll();
+	if(headless) {
+		fprintf(stderr, "warning: %s\n", msg);
+		return;
+	}
+	addLine(LINE_WARN, NULL, NULL, msg, Scrollback::MAX_TEXT);
+}
+
+// Records a line in the history, and draws it too if the view is following
+// and the line passes the current filter.
+void addLine(LineKind kind, const char * channel, const char * user, const char * text, size_t textMax) {
+	uint32_t channelId = channel == NULL ? Scrollback::NO_NAME : history->intern(channel, CHANNEL_MAX);
+	uint32_t userId = user == NULL ? Scrollback::NO_NAME : history->intern(user, USERNAME_MAX);
+	size_t textLen = text == NULL ? 0 : strnlen(text, textMax);
+	history->append(kind, channelId, userId, text, textLen);
+	if(following) {
+		ScrollbackLine l;
+		history->get(history->endLine() - 1, l);
+		if(viewFilter.matches(*history, l)) {
+			drawLine(l);
+			scheduleRefresh();
+		}
+	} else {
+		updateStatus();
+	}
+}
+
+void drawLine(const ScrollbackLine & l) {
+	const char * channel = history->nameOf(l.channel);
+	const char * user = history->nameOf(l.user);
+	switch(l.kind) {
+		case LINE_SAY:
+			wprintw(wnd, "[");
+			wattron(wnd, COLOR_PAIR(3));
+			wprintw(wnd, "%.32s", channel);
+			wattroff(wnd, COLOR_PAIR(3));
+			wprintw(wnd, "][");
+			wattron(wnd, COLOR_PAIR(4));
+			wprintw(wnd, "%.32s", user);
+			wattroff(wnd, COLOR_PAIR(4));
+			wprintw(wnd, "]: %.*s\n", (int) l.textLen, l.text);
+			break;
+		case LINE_ERROR:
+			wattron(wnd, COLOR_PAIR(1));
+			wprintw(wnd, "Error: ");
+			wattroff(wnd, COLOR_PAIR(1));
+			wprintw(wnd, "%.*s\n", (int) l.textLen, l.text);
+			break;
+		case LINE_WARN:
+			wattron(wnd, COLOR_PAIR(2));
+			wprintw(wnd, "Warning: ");
+			wattroff(wnd, COLOR_PAIR(2));
+			wprintw(wnd, "%.*s\n", (int) l.textLen, l.text);
+			break;
+		case LINE_INFO:
+			wprintw(wnd, "%.*s\n", (int) l.textLen, l.text);
+			break;
+		case LINE_LIST_HEADER:
+			wattron(wnd, A_BOLD);
+			wprintw(wnd, "Existing channels:\n");
+			wattroff(wnd, A_BOLD);
+			break;
+		case LINE_CHANNEL:
+			wattron(wnd, COLOR_PAIR(3));
+			wprintw(wnd, "\t%.32s\n", channel);
+			wattroff(wnd, COLOR_PAIR(3));
+			break;
+		case LINE_WHO_HEADER:
+			wattron(wnd, A_BOLD);
+			wprintw(wnd, "Users on channel ");
+			wattron(wnd, COLOR_PAIR(3));
+			wprintw(wnd, "%.32s", channel);
+			wattroff(wnd, COLOR_PAIR(3));
+			wprintw(wnd, ":\n");
+			wattroff(wnd, A_BOLD);
+			break;
+		case LINE_USER:
+			wattron(wnd, COLOR_PAIR(4));
+			wprintw(wnd, "\t%.32s\n", user);
+			wattroff(wnd, COLOR_PAIR(4));
+			break;
+		case LINE_JOINED:
+		case LINE_LEFT:
+			wprintw(wnd, "[");
+			wattron(wnd, COLOR_PAIR(3));
+			wprintw(wnd, "%.32s", channel);
+			wattroff(wnd, COLOR_PAIR(3));
+			wprintw(wnd, "] ");
+			wattron(wnd, COLOR_PAIR(4));
+			wprintw(wnd, "%.32s", user);
+			wattroff(wnd, COLOR_PAIR(4));
+			wprintw(wnd, l.kind == LINE_JOINED ? " joined\n" : " left\n");
+			break;
+	}
+}
+
+// Lines per page: every drawn line ends in a newline, so the bottom row of
+// the message window stays empty.
+static int pageRows(void) {
+	return std::max(termRows - 4, 1);
+}
+
+// Repaints the message window with the page of matching lines ending at the
+// current view position.
+void redrawHistory(void) {
+	const int rows = pageRows();
+	std::vector<uint64_t> page;
+	uint64_t pos = following ? history->endLine() : viewEnd;
+	uint64_t found;
+	while((int) page.size() < rows && history->findPrev(pos, viewFilter, found)) {
+		page.push_back(found);
+		pos = found;
+	}
+	werase(wnd);
+	ScrollbackLine l;
+	for(int i = page.size() - 1; i >= 0; --i) {
+		if(history->get(page[i], l)) {
+			drawLine(l);
+		}
+	}
+	updateStatus();
+	scheduleRefresh();
+}
+
+void pageUp(void) {
+	const int rows = pageRows();
+	uint64_t pos = following ? history->endLine() : viewEnd;
+	uint64_t found;
+	for(int n = 0; n < rows && history->findPrev(pos, viewFilter, found); ++n) {
+		pos = found;
+	}
+	// pos is now the top line on screen; only move if there is more above it.
+	if(!history->findPrev(pos, viewFilter, found)) {
+		return;
+	}
+	viewEnd = pos;
+	following = false;
+	redrawHistory();
+}
+
+void pageDown(void) {
+	if(following) {
+		return;
+	}
+	const int rows = pageRows();
+	uint64_t pos = viewEnd;
+	uint64_t found;
+	int n = 0;
+	for(; n < rows && history->findNext(pos, viewFilter, found); ++n) {
+		pos = found + 1;
+	}
+	if(n < rows || pos >= history->endLine()) {
+		following = true;
+	} else {
+		viewEnd = pos;
+	}
+	redrawHistory();
+}
+
+// Shows scroll position and the active filter in the separator line above
+// the input.
+void updateStatus(void) {
+	wmove(inputWnd, 0, 0);
+	whline(inputWnd, '-', termCols);
+	char status[256];
+	int len = 0;
+	if(!following) {
+		len += snprintf(status + len, sizeof(status) - len, " history: line %llu of %llu ",
+			(unsigned long long) viewEnd, (unsigned long long) history->endLine());
+	}
+	if(viewFilter.channel != Scrollback::NO_NAME) {
+		len += snprintf(status + len, sizeof(status) - len, " channel: %.32s ", history->nameOf(viewFilter.channel));
+	}
+	if(!viewFilter.substring.empty()) {
+		len += snprintf(status + len, sizeof(status) - len, " search: %.64s ", viewFilter.substring.c_str());
+	}
+	if(len > 0) {
+		mvwprintw(inputWnd, 0, 2, "%.*s", termCols - 4, status);
+	}
+	wmove(inputWnd, 1, nchars + 2);
+	scheduleRefresh();
 }
 
 void clearInput(void) {
@@ -471,12 +1139,56 @@ void clearInput(void) {
 	wmove(inputWnd, 1, 0);
 	waddch(inputWnd, '>' | A_BOLD);
 	waddch(inputWnd, ' ');
-	refreshAll();
+	scheduleRefresh();
 }
 
+static double secondsSince(const struct timespec * then) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) + (now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+// Pushes both windows to the terminal right away, with a single doupdate().
 void refreshAll(void) {
-	wrefresh(wnd);
-	wrefresh(inputWnd);
+	wnoutrefresh(wnd);
+	wnoutrefresh(inputWnd);
+	doupdate();
+	++framesDrawn;
+	refreshPending = false;
+	clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+}
+
+// Marks the screen dirty; the next renderFrame() after the frame interval
+// has elapsed will draw it.
+void scheduleRefresh(void) {
+	refreshPending = true;
+}
+
+void renderFrame(void) {
+	if(refreshPending && secondsSince(&lastFrame) >= 1.0 / frameRate) {
+		refreshAll();
+	}
+}
+
+// Sleeps until the socket or the keyboard has something for us, a pending
+// frame comes due, SIGALRM interrupts us for a keep-alive, or idleTimeout
+// milliseconds pass (-1 waits indefinitely).
+void waitForEvents(int sock, int idleTimeout) {
+	struct pollfd fds[3];
+	fds[0].fd = sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = STDIN_FILENO;
+	fds[1].events = POLLIN;
+	fds[2].fd = mcastSock;
+	fds[2].events = POLLIN;
+	int timeout = idleTimeout;
+	if(refreshPending) {
+		timeout = (int) ((1.0 / frameRate - secondsSince(&lastFrame)) * 1000);
+		if(timeout < 0) {
+			timeout = 0;
+		}
+	}
+	poll(fds, 3, timeout);
 }
 
 void setupTerminal(void) {
@@ -495,6 +1207,7 @@ void setupTerminal(void) {
 	wsetscrreg(wnd, 0, termRows-3);
 	scrollok(wnd, true);
     inputWnd = newwin(3, termCols, termRows-3, 0);
+    keypad(inputWnd, TRUE);
     whline(inputWnd, '-', termCols);
     wmove(inputWnd, 1, 0);
 	nodelay(wnd, true);
@@ -515,3 +1228,176 @@ void timerExpired(int signum) {
 	signal(SIGALRM, timerExpired);
 	alarm(KEEP_ALIVE_FREQ);
 }
+
+// Render benchmark: a forked child blasts count text_say packets at a
+// loopback socket while the usual drain/render loop displays them.  Reports
+// how fast messages made it onto the screen and how many were dropped.
+int runRenderBenchmark(int count) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bench socket");
+		exit(-5);
+	}
+	socklen_t addrLen = sizeof(addr);
+	getsockname(sock, (struct sockaddr *)&addr, &addrLen);
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &CLIENT_RCVBUF, sizeof(CLIENT_RCVBUF));
+
+	buf = (text *) malloc(MAX_BUFFER_SIZE);
+	benchMode = true;
+	memset(curChannel, '\0', CHANNEL_MAX+1);
+	strncpy(curChannel, "bench", CHANNEL_MAX);
+
+	setupTerminal();
+	clearInput();
+	refreshAll();
+	framesDrawn = 0;
+
+	pid_t child = fork();
+	if(child == 0) {
+		int out = socket(AF_INET, SOCK_DGRAM, 0);
+		struct text_say pkt;
+		memset(&pkt, '\0', sizeof(pkt));
+		pkt.txt_type = htonl(TXT_SAY);
+		strncpy(pkt.txt_channel, "bench", CHANNEL_MAX);
+		strncpy(pkt.txt_username, "bench", USERNAME_MAX);
+		for(int i = 0; i < count; ++i) {
+			snprintf(pkt.txt_text, SAY_MAX, "synthetic message %d", i);
+			while(sendto(out, &pkt, sizeof(pkt), 0, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ENOBUFS) {
+			}
+		}
+		_exit(0);
+	}
+
+	struct timespec start, lastArrival;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	lastArrival = start;
+	long lastCount = 0;
+	while(benchReceived < count) {
+		waitForEvents(sock, 1000);
+		handleNetwork(sock, NULL);
+		renderFrame();
+		if(benchReceived != lastCount) {
+			lastCount = benchReceived;
+			clock_gettime(CLOCK_MONOTONIC, &lastArrival);
+		} else if(secondsSince(&lastArrival) > 1.0) {
+			break;		// Whatever is missing was dropped.
+		}
+	}
+	refreshAll();
+	double elapsed = secondsSince(&start);
+	if(benchReceived < count) {
+		elapsed -= secondsSince(&lastArrival);
+	}
+
+	waitpid(child, NULL, 0);
+	restoreTerminal();
+	free(buf);
+
+	printf("rendered %ld of %d messages in %.3f s (%.0f msgs/s) using %ld frames at <= %d fps, %ld dropped\n",
+		benchReceived, count, elapsed, benchReceived / elapsed, framesDrawn, frameRate, count - benchReceived);
+	return benchReceived == count ? 0 : 1;
+}
+
+// Headless frontend.  Input is read in blocks and every complete line is
+// executed immediately, so a script's sends go out back to back.  Received
+// packets become one tab-separated record per line on stdout:
+//
+//	SAY	channel	user	text
+//	LIST	count	channel...
+//	WHO	channel	count	user...
+//	PRESENCE	channel	count	{+|-}user...
+//	JOIN	count	{channel	status}...	(status: ok, already, full, too_many)
+//	ERROR	text
+//
+// Backslash, tab and newline inside fields are escaped as \\, \t and \n.
+// Once input ends we keep listening for linger seconds to collect replies.
+int runHeadless(int sock, struct addrinfo * p, int inputFd, int linger) {
+	static char out[1 << 16];
+	setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+	line = new char[MAXLINE+1];
+	signal(SIGALRM, timerExpired);
+	alarm(KEEP_ALIVE_FREQ);
+
+	std::string pending;
+	char chunk[4096];
+	bool inputOpen = true;
+	bool done = false;
+	struct timespec closedAt;
+	while(!done) {
+		struct pollfd fds[3];
+		fds[0].fd = sock;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = inputOpen ? inputFd : -1;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		fds[2].fd = mcastSock;
+		fds[2].events = POLLIN;
+		fds[2].revents = 0;
+		int timeout = -1;
+		if(!inputOpen) {
+			timeout = (int) ((linger - secondsSince(&closedAt)) * 1000);
+			if(timeout < 0) {
+				timeout = 0;
+			}
+		}
+		poll(fds, 3, timeout);
+
+		if(timeForKeepAlive) {
+			sendKeepAlivePacket(sock, p);
+			timeForKeepAlive = false;
+		}
+		handleNetwork(sock, p);
+
+		if(inputOpen && (fds[1].revents & (POLLIN | POLLHUP))) {
+			ssize_t n = read(inputFd, chunk, sizeof(chunk));
+			if(n > 0) {
+				pending.append(chunk, n);
+			} else if(n == 0) {
+				inputOpen = false;
+				clock_gettime(CLOCK_MONOTONIC, &closedAt);
+				if(!pending.empty()) {
+					pending += '\n';
+				}
+			}
+			size_t start = 0, end;
+			while(!done && (end = pending.find('\n', start)) != std::string::npos) {
+				nchars = std::min(end - start, (size_t) MAXLINE);
+				memset(line, '\0', MAXLINE+1);
+				memcpy(line, pending.data() + start, nchars);
+				if(nchars > 0 && line[nchars-1] == '\r') {
+					line[--nchars] = '\0';
+				}
+				if(nchars > 0 && !runCommand(sock, p)) {
+					done = true;
+				}
+				start = end + 1;
+			}
+			pending.erase(0, start);
+		}
+		fflush(stdout);
+
+		if(!inputOpen && secondsSince(&closedAt) >= linger) {
+			done = true;
+		}
+	}
+	delete [] line;
+	return 0;
+}
+
+void writeField(const char * s, size_t max) {
+	for(size_t i = 0; i < max && s[i] != '\0'; ++i) {
+		switch(s[i]) {
+			case '\\': fputs("\\\\", stdout); break;
+			case '\t': fputs("\\t", stdout); break;
+			case '\n': fputs("\\n", stdout); break;
+			default: putchar(s[i]);
+		}
+	}
+}
@@ -16,6 +16,8 @@
 #define USERNAME_MAX 32
 #define CHANNEL_MAX 32
 #define SAY_MAX 64
+#define SESSION_TOKEN_LEN 16
+#define JOIN_MANY_MAX 48 /* Channels in one REQ_JOIN_MANY */
 
 /* Define some types for designating request and text codes */
 typedef int request_t;
@@ -30,12 +32,25 @@ typedef int text_t;
 #define REQ_LIST 5
 #define REQ_WHO 6
 #define REQ_KEEP_ALIVE 7 /* Only needed by graduate students */
+#define REQ_PRESENCE 8 /* Subscribe to membership changes of a channel */
+#define REQ_JOIN_MANY 9 /* Join several channels at once */
+#define REQ_MULTICAST_ACK 10 /* Client has joined a channel's multicast group */
 
 /* Define codes for text types.  These are the messages sent to the client. */
 #define TXT_SAY 0
 #define TXT_LIST 1
 #define TXT_WHO 2
 #define TXT_ERROR 3
+#define TXT_PRESENCE 4 /* Batch of joins and parts on a subscribed channel */
+#define TXT_SESSION 5 /* Resumption token, sent in reply to a login */
+#define TXT_JOIN_RESULT 6 /* Outcome of each join in a REQ_JOIN_MANY */
+#define TXT_MULTICAST 7 /* A channel's says now go to a multicast group */
+
+/* Join outcomes */
+#define JOIN_OK 0
+#define JOIN_ALREADY_MEMBER 1
+#define JOIN_CHANNEL_FULL 2
+#define JOIN_TOO_MANY_CHANNELS 3
 
 /* This structure is used for a generic request type, to the server. */
 struct request {
@@ -84,6 +99,39 @@ struct request_keep_alive {
         request_t req_type; /* = REQ_KEEP_ALIVE */
 } packed;
 
+/* A keep-alive that also carries the session's resumption token.  If it
+ * arrives from an address the server doesn't know (say the client's NAT
+ * mapping changed), the session moves to that address, channels and all. */
+struct request_keep_alive_token {
+        request_t req_type; /* = REQ_KEEP_ALIVE */
+        char req_token[SESSION_TOKEN_LEN];
+} packed;
+
+/* Answered with TXT_JOIN_RESULT.  The server may split the results over
+ * several datagrams, but reports every channel exactly once. */
+struct request_join_many {
+        request_t req_type; /* = REQ_JOIN_MANY */
+        int req_nchannels; /* At most JOIN_MANY_MAX */
+        char req_channels[0][CHANNEL_MAX]; // May actually be more than 0
+} packed;
+
+/* Subscribing replies with one TXT_WHO snapshot of the channel; after that
+ * the server pushes TXT_PRESENCE deltas instead of the client polling. */
+struct request_presence {
+        request_t req_type; /* = REQ_PRESENCE */
+        int req_subscribe; /* 1 to subscribe, 0 to unsubscribe */
+        char req_channel[CHANNEL_MAX];
+} packed;
+
+/* Confirms that the client has joined the group a TXT_MULTICAST announced.
+ * Until the server gets this, it keeps sending that client's copies of the
+ * channel's says by unicast. */
+struct request_multicast_ack {
+        request_t req_type; /* = REQ_MULTICAST_ACK */
+        char req_channel[CHANNEL_MAX];
+        unsigned int req_group; /* As announced, network byte order */
+} packed;
+
 /* This structure is used for a generic text type, to the client. */
 struct text {
         text_t txt_type;
@@ -123,6 +171,47 @@ struct text_who {
         struct user_info txt_users[0]; // May actually be more than 0
 } packed;
 
+/* This is a substructure used by text_presence. */
+struct presence_change {
+        char pc_username[USERNAME_MAX];
+        int pc_joined; /* 1 if the user joined, 0 if they left */
+} packed;
+
+struct text_presence {
+        text_t txt_type; /* = TXT_PRESENCE */
+        char txt_channel[CHANNEL_MAX];
+        int txt_nchanges;
+        struct presence_change txt_changes[0]; // May actually be more than 0
+} packed;
+
+/* This is a substructure used by text_join_result. */
+struct join_result {
+        char jr_channel[CHANNEL_MAX];
+        int jr_status; /* One of the JOIN_* outcomes */
+} packed;
+
+struct text_join_result {
+        text_t txt_type; /* = TXT_JOIN_RESULT */
+        int txt_nresults;
+        struct join_result txt_results[0]; // May actually be more than 0
+} packed;
+
+/* From now on the channel's says are sent once, to this IPv4 multicast
+ * group and port, instead of to each member.  Join the group and answer
+ * with REQ_MULTICAST_ACK.  A group of 0 means the channel is back to
+ * unicast and the group can be left. */
+struct text_multicast {
+        text_t txt_type; /* = TXT_MULTICAST */
+        char txt_channel[CHANNEL_MAX];
+        unsigned int txt_group; /* Network byte order */
+        unsigned short txt_port; /* Network byte order */
+} packed;
+
+struct text_session {
+        text_t txt_type; /* = TXT_SESSION */
+        char txt_token[SESSION_TOKEN_LEN];
+} packed;
+
 struct text_error {
         text_t txt_type; /* = TXT_ERROR */
         char txt_error[SAY_MAX]; // Error message
@@ -0,0 +1,213 @@
+/*
+ *	egress.cpp
+ *	Non-blocking sends with per-destination backlogs.
+ */
+
+#include "egress.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+
+const double ENOBUFS_RETRY = 0.001;		// Seconds to back off when the interface queue is full
+
+static double monotonicNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+Packet * newPacket(const void * data, size_t len) {
+	Packet * pkt = (Packet *) malloc(sizeof(Packet) + len);
+	pkt->refs = 1;
+	pkt->len = len;
+	memcpy(pkt->data, data, len);
+	return pkt;
+}
+
+void retainPacket(Packet * pkt) {
+	__atomic_add_fetch(&pkt->refs, 1, __ATOMIC_RELAXED);
+}
+
+void releasePacket(Packet * pkt) {
+	if(__atomic_sub_fetch(&pkt->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(pkt);
+	}
+}
+
+Egress::Egress(int sock) : destinationMax(DEFAULT_DESTINATION_MAX), backlogMax(DEFAULT_BACKLOG_MAX),
+		backlogBytesMax(DEFAULT_BACKLOG_BYTES), sent(0), queued(0), pushedBack(0), droppedDestination(0),
+		droppedBacklog(0), errors(0), peakBacklog(0), sock(sock), backlog(0), backlogBytes(0),
+		blocked(false), retryAt(0) {
+}
+
+Egress::~Egress() {
+	for(std::map<std::string, Destination *>::iterator it = destinations.begin(); it != destinations.end(); ++it) {
+		for(size_t i = 0; i < it->second->packets.size(); ++i) {
+			releasePacket(it->second->packets[i]);
+		}
+		delete it->second;
+	}
+}
+
+// Only the parts of the address that name the destination, so padding in a
+// sockaddr_in can't make one user look like two.
+std::string Egress::keyOf(const struct sockaddr_storage * address, socklen_t len) {
+	if(address->ss_family == AF_INET) {
+		const struct sockaddr_in * in = (const struct sockaddr_in *) address;
+		std::string key((const char *) &in->sin_addr, sizeof(in->sin_addr));
+		key.append((const char *) &in->sin_port, sizeof(in->sin_port));
+		return key;
+	} else if(address->ss_family == AF_INET6) {
+		const struct sockaddr_in6 * in6 = (const struct sockaddr_in6 *) address;
+		std::string key((const char *) &in6->sin6_addr, sizeof(in6->sin6_addr));
+		key.append((const char *) &in6->sin6_port, sizeof(in6->sin6_port));
+		return key;
+	}
+	return std::string((const char *) address, len);
+}
+
+Egress::Outcome Egress::trySend(const void * data, size_t len, const struct sockaddr_storage * to, socklen_t toLen) {
+	while(true) {
+		if(sendto(sock, data, len, MSG_DONTWAIT, (const struct sockaddr *) to, toLen) != -1) {
+			++sent;
+			return SENT;
+		}
+		if(errno == EINTR) {
+			continue;
+		}
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			++pushedBack;
+			blocked = true;
+			return PUSHED_BACK;
+		}
+		if(errno == ENOBUFS) {
+			++pushedBack;
+			retryAt = monotonicNow() + ENOBUFS_RETRY;
+			return PUSHED_BACK;
+		}
+		++errors;
+		return FAILED;
+	}
+}
+
+void Egress::enqueue(Packet * pkt, const struct sockaddr_storage * to, socklen_t toLen) {
+	if(backlog >= backlogMax || backlogBytes + pkt->len > backlogBytesMax) {
+		++droppedBacklog;
+		return;
+	}
+	std::string key = keyOf(to, toLen);
+	std::map<std::string, Destination *>::iterator it = destinations.find(key);
+	Destination * dest;
+	if(it == destinations.end()) {
+		dest = new Destination;
+		memcpy(&dest->address, to, toLen);
+		dest->addrLen = toLen;
+		dest->key = key;
+		destinations[key] = dest;
+	} else {
+		dest = it->second;
+	}
+	if(dest->packets.size() >= destinationMax) {
+		++droppedDestination;
+		return;
+	}
+	if(dest->packets.empty()) {
+		ready.push_back(dest);
+	}
+	retainPacket(pkt);
+	dest->packets.push_back(pkt);
+	++queued;
+	++backlog;
+	backlogBytes += pkt->len;
+	if(backlog > peakBacklog) {
+		peakBacklog = backlog;
+	}
+}
+
+int Egress::send(Packet * pkt, const struct sockaddr_storage * to, socklen_t toLen) {
+	// With a backlog, new datagrams take their turn behind it, or they would
+	// overtake earlier ones to the same user and crowd out the rest.
+	if(backlog == 0) {
+		Outcome outcome = trySend(pkt->data, pkt->len, to, toLen);
+		if(outcome == SENT) {
+			return pkt->len;
+		} else if(outcome == FAILED) {
+			return -1;
+		}
+	}
+	enqueue(pkt, to, toLen);
+	return pkt->len;
+}
+
+int Egress::send(const void * data, size_t len, const struct sockaddr_storage * to, socklen_t toLen) {
+	if(backlog == 0) {
+		Outcome outcome = trySend(data, len, to, toLen);
+		if(outcome == SENT) {
+			return len;
+		} else if(outcome == FAILED) {
+			return -1;
+		}
+	}
+	Packet * pkt = newPacket(data, len);
+	enqueue(pkt, to, toLen);
+	releasePacket(pkt);
+	return len;
+}
+
+void Egress::drain() {
+	if(backlog == 0 || retryDelay() != 0) {
+		return;
+	}
+	blocked = false;
+	while(!ready.empty()) {
+		Destination * dest = ready.front();
+		Packet * pkt = dest->packets.front();
+		Outcome outcome = trySend(pkt->data, pkt->len, &dest->address, dest->addrLen);
+		if(outcome == PUSHED_BACK) {
+			// Still this destination's turn when the socket has room.
+			return;
+		}
+		if(outcome == FAILED) {
+			perror("while sending from egress backlog");
+		}
+		dest->packets.pop_front();
+		--backlog;
+		backlogBytes -= pkt->len;
+		releasePacket(pkt);
+		ready.pop_front();
+		if(dest->packets.empty()) {
+			destinations.erase(dest->key);
+			delete dest;
+		} else {
+			ready.push_back(dest);
+		}
+	}
+}
+
+int Egress::retryDelay() const {
+	if(blocked) {
+		return -1;
+	}
+	double wait = retryAt - monotonicNow();
+	return wait > 0 ? (int) (wait * 1000) + 1 : 0;
+}
+
+void Egress::waitWritable(int timeout) {
+	int delay = retryDelay();
+	if(delay == 0) {
+		return;
+	}
+	if(delay > 0 && (timeout < 0 || delay < timeout)) {
+		timeout = delay;
+	}
+	struct pollfd pfd;
+	pfd.fd = blocked ? sock : -1;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	poll(&pfd, 1, timeout);
+}
@@ -0,0 +1,114 @@
+#ifndef EGRESS_H
+#define EGRESS_H
+
+/*
+ *	egress.h
+ *	Non-blocking datagram sending with a bounded backlog.
+ *
+ *	Sends go straight to the socket (with MSG_DONTWAIT) while nothing is
+ *	waiting.  Once the kernel pushes back, with EAGAIN because the send
+ *	buffer is full or ENOBUFS because the interface queue is, datagrams are
+ *	queued per destination instead of blocking the caller, and drain()
+ *	sends them when the socket has room again: one datagram per destination
+ *	in turn, so a user who is owed a pile of WHO replies can't hold up
+ *	everyone else's says.  Each destination's queue, and the backlog as a
+ *	whole, is bounded; anything past that is dropped and counted.
+ *
+ *	Only one thread may use an Egress.  Several may share a socket.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// A reference-counted datagram, so one say can be queued for every member
+// without copying it per recipient.
+struct Packet {
+	int refs;
+	size_t len;
+	char data[1];
+};
+
+// Returns a packet holding one reference.
+Packet * newPacket(const void * data, size_t len);
+void retainPacket(Packet * pkt);
+void releasePacket(Packet * pkt);
+
+class Egress {
+public:
+	static const size_t DEFAULT_DESTINATION_MAX = 512;		// Datagrams queued for one address
+	static const size_t DEFAULT_BACKLOG_MAX = 65536;		// Datagrams queued in all
+	static const size_t DEFAULT_BACKLOG_BYTES = 64 << 20;
+
+	Egress(int sock);
+	~Egress();
+
+	// Sends the datagram now if it can, queues it if not.  The Packet form
+	// takes its own reference when queueing; the other copies the data only
+	// if it has to.  Returns -1 only for a hard error, with errno set; a
+	// datagram dropped for lack of room is counted, not reported.
+	int send(Packet * pkt, const struct sockaddr_storage * to, socklen_t toLen);
+	int send(const void * data, size_t len, const struct sockaddr_storage * to, socklen_t toLen);
+
+	// Sends queued datagrams, round robin by destination, until the socket
+	// pushes back or the backlog is empty.
+	void drain();
+
+	bool pending() const {
+		return backlog > 0;
+	}
+
+	// What the backlog is waiting for: POLLOUT on the socket, or (after
+	// ENOBUFS, which no poll reports) just time.  retryDelay() is a poll()
+	// timeout in milliseconds: -1 to wait for POLLOUT, 0 if drain() can go
+	// ahead now.
+	bool wantsWritable() const {
+		return blocked;
+	}
+	int retryDelay() const;
+
+	// Waits up to timeout milliseconds for the backlog to be able to move.
+	void waitWritable(int timeout);
+
+	size_t destinationMax;
+	size_t backlogMax;
+	size_t backlogBytesMax;
+
+	unsigned long sent;
+	unsigned long queued;			// Datagrams that had to wait
+	unsigned long pushedBack;		// EAGAIN or ENOBUFS from the kernel
+	unsigned long droppedDestination;	// Destination's queue was full
+	unsigned long droppedBacklog;	// Whole backlog was full
+	unsigned long errors;			// Anything else; the datagram is dropped
+	size_t peakBacklog;
+
+private:
+	struct Destination {
+		struct sockaddr_storage address;
+		socklen_t addrLen;
+		std::string key;
+		std::deque<Packet *> packets;
+	};
+
+	int sock;
+	std::map<std::string, Destination *> destinations;
+	std::deque<Destination *> ready;	// Destinations with something queued, next turn first
+	size_t backlog;
+	size_t backlogBytes;
+	bool blocked;					// Waiting for POLLOUT
+	double retryAt;					// After ENOBUFS, monotonic seconds
+
+	enum Outcome { SENT, PUSHED_BACK, FAILED };
+	Outcome trySend(const void * data, size_t len, const struct sockaddr_storage * to, socklen_t toLen);
+	void enqueue(Packet * pkt, const struct sockaddr_storage * to, socklen_t toLen);
+	static std::string keyOf(const struct sockaddr_storage * address, socklen_t len);
+
+	Egress(const Egress &);
+	Egress & operator=(const Egress &);
+};
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ *	loadgen.cpp
+ *	Load generator for the DuckChat server.
+ *
+ *	Logs in a number of clients on their own UDP sockets, joins them all to
+ *	one channel and has them say things as fast as allowed (or at a fixed
+ *	rate) for a while.  Every say fans out to every member, so the server
+ *	handles `requests` packets in and `requests * clients` packets out.
+ *	Reports request and delivery rates and, given the server's pid, the
+ *	server CPU time spent per request.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "duckchat.h"
+
+using namespace std;
+
+const int DEFAULT_CLIENTS = 8;
+const int DEFAULT_SECONDS = 5;
+const int RCVBUF = 1 << 20;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// utime + stime of a process in seconds, from /proc.  -1 if unavailable.
+static double processCpu(int pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE * f = fopen(path, "r");
+	if(f == NULL) {
+		return -1;
+	}
+	char line[1024];
+	double cpu = -1;
+	if(fgets(line, sizeof(line), f) != NULL) {
+		// Fields after the parenthesised command name; utime and stime are
+		// the 14th and 15th fields overall.
+		char * rest = strrchr(line, ')');
+		unsigned long utime, stime;
+		if(rest != NULL && sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2) {
+			cpu = (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+		}
+	}
+	fclose(f);
+	return cpu;
+}
+
+static void sendRequest(int sock, struct addrinfo * server, const void * pkt, size_t len) {
+	while(sendto(sock, pkt, len, 0, server->ai_addr, server->ai_addrlen) == -1) {
+		if(errno != ENOBUFS && errno != EAGAIN) {
+			perror("sendto");
+			return;
+		}
+	}
+}
+
+// Reads everything waiting on the client sockets; returns datagrams seen.
+static long drain(vector<int> & socks, char * buf, size_t bufLen) {
+	long n = 0;
+	for(size_t i = 0; i < socks.size(); ++i) {
+		while(recv(socks[i], buf, bufLen, MSG_DONTWAIT) > 0) {
+			++n;
+		}
+	}
+	return n;
+}
+
+int main(int argc, char ** argv) {
+	int clients = DEFAULT_CLIENTS;
+	int seconds = DEFAULT_SECONDS;
+	long rate = 0;
+	int serverPid = 0;
+	const char * channel = "load";
+	int opt;
+	while((opt = getopt(argc, argv, "c:d:r:P:C:")) != -1) {
+		switch(opt) {
+			case 'c': clients = atoi(optarg); break;
+			case 'd': seconds = atoi(optarg); break;
+			case 'r': rate = atol(optarg); break;
+			case 'P': serverPid = atoi(optarg); break;
+			case 'C': channel = optarg; break;
+			default:
+				cerr << "usage: " << argv[0] << " [-c clients] [-d seconds] [-r requests_per_sec] [-P server_pid] [-C channel] server_name port" << endl;
+				exit(-1);
+		}
+	}
+	if(argc - optind != 2 || clients < 1 || seconds < 1) {
+		cerr << "usage: " << argv[0] << " [-c clients] [-d seconds] [-r requests_per_sec] [-P server_pid] [-C channel] server_name port" << endl;
+		exit(-1);
+	}
+
+	struct addrinfo hints, *server;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	int status = getaddrinfo(argv[optind], argv[optind+1], &hints, &server);
+	if(status != 0) {
+		cerr << "error: unable to resolve address: " << gai_strerror(status) << endl;
+		exit(-4);
+	}
+
+	vector<int> socks;
+	for(int i = 0; i < clients; ++i) {
+		int s = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+		if(s == -1) {
+			perror("socket");
+			exit(-5);
+		}
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &RCVBUF, sizeof(RCVBUF));
+		socks.push_back(s);
+
+		struct request_login login;
+		memset(&login, 0, sizeof(login));
+		login.req_type = htonl(REQ_LOGIN);
+		snprintf(login.req_username, USERNAME_MAX, "load%d", i);
+		sendRequest(s, server, &login, sizeof(login));
+		struct request_join join;
+		memset(&join, 0, sizeof(join));
+		join.req_type = htonl(REQ_JOIN);
+		strncpy(join.req_channel, channel, CHANNEL_MAX);
+		sendRequest(s, server, &join, sizeof(join));
+	}
+	usleep(200000);
+	char buf[65536];
+	drain(socks, buf, sizeof(buf));
+
+	struct request_say say;
+	memset(&say, 0, sizeof(say));
+	say.req_type = htonl(REQ_SAY);
+	strncpy(say.req_channel, channel, CHANNEL_MAX);
+	strncpy(say.req_text, "load", SAY_MAX);
+
+	double cpuStart = serverPid ? processCpu(serverPid) : -1;
+	double start = now();
+	double end = start + seconds;
+	long sent = 0, received = 0;
+	while(now() < end) {
+		// Send a burst, then collect what came back.
+		long burst = 64;
+		if(rate > 0) {
+			long due = (long) ((now() - start) * rate) - sent;
+			burst = due < 0 ? 0 : (due > 256 ? 256 : due);
+		}
+		for(long i = 0; i < burst; ++i) {
+			sendRequest(socks[sent % clients], server, &say, sizeof(say));
+			++sent;
+		}
+		received += drain(socks, buf, sizeof(buf));
+		if(burst == 0) {
+			usleep(100);
+		}
+	}
+	double sendElapsed = now() - start;
+	double cpuEnd = serverPid ? processCpu(serverPid) : -1;
+
+	// Give the server a moment to finish the fan-out still in flight.
+	double settle = now() + 0.5;
+	while(now() < settle) {
+		received += drain(socks, buf, sizeof(buf));
+		usleep(1000);
+	}
+
+	struct request_logout logout;
+	logout.req_type = htonl(REQ_LOGOUT);
+	for(int i = 0; i < clients; ++i) {
+		sendRequest(socks[i], server, &logout, sizeof(logout));
+		close(socks[i]);
+	}
+
+	long expected = sent * clients;
+	printf("clients %d, duration %.2f s\n", clients, sendElapsed);
+	printf("requests sent      %ld (%.0f/s)\n", sent, sent / sendElapsed);
+	printf("datagrams received %ld of %ld expected (%.0f/s, %.2f%% lost)\n",
+		received, expected, received / sendElapsed, expected ? 100.0 * (expected - received) / expected : 0.0);
+	if(cpuStart >= 0 && cpuEnd >= 0) {
+		double cpu = cpuEnd - cpuStart;
+		printf("server cpu         %.2f s (%.1f%% of one core), %.2f us/request, %.3f us/datagram out\n",
+			cpu, 100.0 * cpu / sendElapsed, sent ? 1e6 * cpu / sent : 0.0, received ? 1e6 * cpu / received : 0.0);
+	}
+	freeaddrinfo(server);
+	return 0;
+}
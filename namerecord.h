@@ -0,0 +1,101 @@
+#ifndef NAMERECORD_H
+#define NAMERECORD_H
+
+/*
+ *	namerecord.h
+ *	User and channel names, interned once in the server as fixed-width,
+ *	zero-padded records laid out exactly like the 32-byte name fields of
+ *	the wire protocol.
+ *
+ *	Copying a name into a packet is then a plain 32-byte block copy, and
+ *	comparing or hashing one works on four 64-bit words instead of walking
+ *	a string to its terminator.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <ostream>
+
+#include "duckchat.h"
+
+const size_t NAME_WIDTH = 32;
+
+union NameRecord {
+	char bytes[NAME_WIDTH];
+	uint64_t words[NAME_WIDTH / 8];
+
+	NameRecord() {
+		clear();
+	}
+
+	// Takes a name from a wire field or C string: everything up to the first
+	// NUL or max bytes, with the rest of the record zeroed so that equal
+	// names always have equal records.
+	explicit NameRecord(const char * s, size_t max = NAME_WIDTH) {
+		set(s, max);
+	}
+
+	void set(const char * s, size_t max = NAME_WIDTH) {
+		if(max > NAME_WIDTH) {
+			max = NAME_WIDTH;
+		}
+		const char * end = (const char *) memchr(s, '\0', max);
+		size_t len = end == NULL ? max : end - s;
+		memcpy(bytes, s, len);
+		memset(bytes + len, '\0', NAME_WIDTH - len);
+	}
+
+	void clear() {
+		for(size_t i = 0; i < NAME_WIDTH / 8; ++i) {
+			words[i] = 0;
+		}
+	}
+
+	bool empty() const {
+		return bytes[0] == '\0';
+	}
+
+	size_t length() const {
+		const char * end = (const char *) memchr(bytes, '\0', NAME_WIDTH);
+		return end == NULL ? NAME_WIDTH : end - bytes;
+	}
+
+	// Fills a USERNAME_MAX or CHANNEL_MAX wire field.
+	void copyTo(char * field) const {
+		memcpy(field, bytes, NAME_WIDTH);
+	}
+
+	bool operator==(const NameRecord & other) const {
+		return ((words[0] ^ other.words[0]) | (words[1] ^ other.words[1]) |
+				(words[2] ^ other.words[2]) | (words[3] ^ other.words[3])) == 0;
+	}
+
+	bool operator!=(const NameRecord & other) const {
+		return !(*this == other);
+	}
+
+	// Byte order, so channel lists still come out alphabetically.
+	bool operator<(const NameRecord & other) const {
+		return memcmp(bytes, other.bytes, NAME_WIDTH) < 0;
+	}
+
+	// Mixes the four words; padding is always zero, so no length is needed.
+	unsigned int hash() const {
+		uint64_t h = 0x9e3779b97f4a7c15ULL;
+		for(size_t i = 0; i < NAME_WIDTH / 8; ++i) {
+			h = (h ^ words[i]) * 0xff51afd7ed558ccdULL;
+			h ^= h >> 32;
+		}
+		return (unsigned int) h;
+	}
+};
+
+inline std::ostream & operator<<(std::ostream & out, const NameRecord & name) {
+	return out.write(name.bytes, name.length());
+}
+
+// The wire format and the records have to agree on the width.
+typedef char NameWidthMatchesUsername[USERNAME_MAX == NAME_WIDTH ? 1 : -1];
+typedef char NameWidthMatchesChannel[CHANNEL_MAX == NAME_WIDTH ? 1 : -1];
+
+#endif
@@ -0,0 +1,370 @@
+/*
+ *	replay.cpp
+ *	Re-sends a traffic capture (server -c) against a DuckChat server.
+ *
+ *	Every source address in the capture gets a local UDP socket of its own,
+ *	so the server sees as many clients as there were originally.  Datagrams
+ *	go out at their captured times, sped up by the scale factor, or as fast
+ *	as possible with -x 0.  Session tokens the replayed server hands out are
+ *	substituted for the captured ones, so keep-alives that resume a session
+ *	still find it.
+ *
+ *	Response latency is measured for requests that draw a direct reply:
+ *	LOGIN (TXT_SESSION), LIST, WHO, JOIN_MANY, and SAY, whose echo comes
+ *	back to the sender when it is in the channel.  A request still waiting
+ *	after the linger time counts as unanswered.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "duckchat.h"
+#include "capture.h"
+
+using namespace std;
+
+const int RCVBUF = 1 << 20;
+const double DEFAULT_LINGER = 1.0;	// Seconds to wait for replies after the last send
+const int MAX_BURST = 64;			// Sends between receive passes at full speed
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct Datagram {
+	double at;			// Seconds since the start of the capture
+	int client;
+	string data;
+};
+
+// A request waiting for its reply.  key narrows down which reply: the
+// channel for WHO, channel and text for SAY.
+struct Pending {
+	int replyType;
+	string key;
+	double sentAt;
+};
+
+struct Client {
+	int sock;
+	char username[USERNAME_MAX];
+	string newToken;			// From the replayed server's TXT_SESSION
+	deque<Pending> pending;
+};
+
+vector<Client> clients;
+map<string, int> clientBySource;
+map<string, string> tokenMap;	// Captured token -> the one we were given
+vector<double> latencies;
+long sent = 0;
+long received = 0;
+long unanswered = 0;
+long tokenMisses = 0;
+
+// The capture's source address, as a map key.
+static string sourceKey(const CaptureRecord & rec) {
+	return string((const char *) &rec.rec_family, sizeof(rec.rec_family)) +
+		string((const char *) &rec.rec_port, sizeof(rec.rec_port)) +
+		string((const char *) rec.rec_addr, sizeof(rec.rec_addr));
+}
+
+static string field(const char * s, size_t max) {
+	return string(s, strnlen(s, max));
+}
+
+static bool loadCapture(const char * path, struct addrinfo * server, vector<Datagram> & out) {
+	FILE * f = fopen(path, "rb");
+	if(f == NULL) {
+		perror(path);
+		return false;
+	}
+	CaptureFileHeader header;
+	if(fread(&header, sizeof(header), 1, f) != 1 || header.cf_magic != CAPTURE_MAGIC) {
+		cerr << "error: " << path << " is not a capture file (or was written on a host of the other byte order)" << endl;
+		fclose(f);
+		return false;
+	}
+	if(header.cf_version != CAPTURE_VERSION) {
+		cerr << "error: " << path << " is capture version " << header.cf_version << ", expected " << CAPTURE_VERSION << endl;
+		fclose(f);
+		return false;
+	}
+	CaptureRecord rec;
+	char data[65536];
+	while(fread(&rec, sizeof(rec), 1, f) == 1) {
+		if(fread(data, 1, rec.rec_length, f) != rec.rec_length) {
+			cerr << "warning: capture ends in a partial record" << endl;
+			break;
+		}
+		string key = sourceKey(rec);
+		map<string, int>::iterator found = clientBySource.find(key);
+		int client;
+		if(found == clientBySource.end()) {
+			Client c;
+			c.sock = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+			if(c.sock == -1) {
+				perror("socket");
+				fclose(f);
+				return false;
+			}
+			fcntl(c.sock, F_SETFL, O_NONBLOCK);
+			setsockopt(c.sock, SOL_SOCKET, SO_RCVBUF, &RCVBUF, sizeof(RCVBUF));
+			memset(c.username, '\0', USERNAME_MAX);
+			client = clients.size();
+			clients.push_back(c);
+			clientBySource[key] = client;
+		} else {
+			client = (*found).second;
+		}
+		Datagram d;
+		d.at = rec.rec_nanos / 1e9;
+		d.client = client;
+		d.data.assign(data, rec.rec_length);
+		out.push_back(d);
+	}
+	fclose(f);
+	return true;
+}
+
+// Notes what reply a request should draw, and swaps in our session token.
+static void prepare(Client & c, string & data, double sentAt) {
+	if(data.size() < sizeof(request)) {
+		return;
+	}
+	char * buf = &data[0];
+	Pending p;
+	p.sentAt = sentAt;
+	p.replyType = -1;
+	switch(ntohl(((request *) buf)->req_type)) {
+		case REQ_LOGIN:
+			if(data.size() >= sizeof(request_login)) {
+				memcpy(c.username, ((request_login *) buf)->req_username, USERNAME_MAX);
+				c.newToken.clear();
+				p.replyType = TXT_SESSION;
+			}
+			break;
+		case REQ_LIST:
+			p.replyType = TXT_LIST;
+			break;
+		case REQ_WHO:
+			if(data.size() >= sizeof(request_who)) {
+				p.replyType = TXT_WHO;
+				p.key = field(((request_who *) buf)->req_channel, CHANNEL_MAX);
+			}
+			break;
+		case REQ_JOIN_MANY:
+			p.replyType = TXT_JOIN_RESULT;
+			break;
+		case REQ_SAY:
+			if(data.size() >= sizeof(request_say)) {
+				request_say * say = (request_say *) buf;
+				p.replyType = TXT_SAY;
+				p.key = field(say->req_channel, CHANNEL_MAX) + '\0' + field(say->req_text, SAY_MAX);
+			}
+			break;
+		case REQ_KEEP_ALIVE:
+			if(data.size() >= sizeof(request_keep_alive_token)) {
+				request_keep_alive_token * ka = (request_keep_alive_token *) buf;
+				string captured(ka->req_token, SESSION_TOKEN_LEN);
+				map<string, string>::iterator found = tokenMap.find(captured);
+				if(found == tokenMap.end() && !c.newToken.empty()) {
+					// First sight of this session's token: it belongs to
+					// whoever sends it, which is this client.
+					found = tokenMap.insert(make_pair(captured, c.newToken)).first;
+				}
+				if(found != tokenMap.end()) {
+					memcpy(ka->req_token, (*found).second.data(), SESSION_TOKEN_LEN);
+				} else {
+					++tokenMisses;
+				}
+			}
+			break;
+	}
+	if(p.replyType != -1) {
+		c.pending.push_back(p);
+	}
+}
+
+static void matchReply(Client & c, const char * buf, int len, double at) {
+	int type = ntohl(((const text *) buf)->txt_type);
+	string key;
+	if(type == TXT_SESSION && len >= (int) sizeof(text_session)) {
+		c.newToken.assign(((const text_session *) buf)->txt_token, SESSION_TOKEN_LEN);
+	} else if(type == TXT_WHO && len >= (int) sizeof(text_who)) {
+		key = field(((const text_who *) buf)->txt_channel, CHANNEL_MAX);
+	} else if(type == TXT_SAY && len >= (int) sizeof(text_say)) {
+		const text_say * say = (const text_say *) buf;
+		if(strncmp(say->txt_username, c.username, USERNAME_MAX) != 0) {
+			return;		// Someone else's message
+		}
+		key = field(say->txt_channel, CHANNEL_MAX) + '\0' + field(say->txt_text, SAY_MAX);
+	}
+	for(deque<Pending>::iterator it = c.pending.begin(); it != c.pending.end(); ++it) {
+		if((*it).replyType == type && (*it).key == key) {
+			latencies.push_back(at - (*it).sentAt);
+			c.pending.erase(it);
+			return;
+		}
+	}
+}
+
+// Reads whatever has arrived on every client socket.
+static void drain() {
+	static char buf[65536];
+	for(size_t i = 0; i < clients.size(); ++i) {
+		int len;
+		while((len = recv(clients[i].sock, buf, sizeof(buf), 0)) > 0) {
+			++received;
+			if(len >= (int) sizeof(text)) {
+				matchReply(clients[i], buf, len, now());
+			}
+		}
+	}
+}
+
+// Sleeps until deadline, or until a client socket has something to read.
+static void waitUntil(double deadline) {
+	static vector<struct pollfd> fds;
+	if(fds.size() != clients.size()) {
+		fds.resize(clients.size());
+		for(size_t i = 0; i < clients.size(); ++i) {
+			fds[i].fd = clients[i].sock;
+			fds[i].events = POLLIN;
+		}
+	}
+	double wait = deadline - now();
+	if(wait > 0) {
+		poll(&fds[0], fds.size(), (int) (wait * 1000));
+	}
+}
+
+static double percentile(const vector<double> & sorted, double p) {
+	if(sorted.empty()) {
+		return 0;
+	}
+	size_t i = (size_t) (p * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+static void usage(const char * name) {
+	cerr << "usage: " << name << " [-x speedup] [-l linger_seconds] capture_file server_name port" << endl;
+	cerr << "  -x 1 keeps the captured timing (default), -x 10 runs ten times faster, -x 0 sends flat out" << endl;
+	exit(-1);
+}
+
+int main(int argc, char ** argv) {
+	double speedup = 1;
+	double linger = DEFAULT_LINGER;
+	int opt;
+	while((opt = getopt(argc, argv, "x:l:")) != -1) {
+		switch(opt) {
+			case 'x': speedup = atof(optarg); break;
+			case 'l': linger = atof(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if(argc - optind != 3 || speedup < 0) {
+		usage(argv[0]);
+	}
+
+	struct addrinfo hints, *server;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	int status = getaddrinfo(argv[optind+1], argv[optind+2], &hints, &server);
+	if(status != 0) {
+		cerr << "error: unable to resolve address: " << gai_strerror(status) << endl;
+		exit(-4);
+	}
+
+	vector<Datagram> capture;
+	if(!loadCapture(argv[optind], server, capture)) {
+		exit(-5);
+	}
+	if(capture.empty()) {
+		cerr << "error: capture is empty" << endl;
+		exit(-5);
+	}
+	cout << "replaying " << capture.size() << " datagrams from " << clients.size() << " sources, "
+		<< capture.back().at << " s captured" << endl;
+
+	double start = now();
+	double maxLag = 0;
+	double totalLag = 0;
+	for(size_t i = 0; i < capture.size(); ++i) {
+		Datagram & d = capture[i];
+		if(speedup > 0) {
+			double due = start + d.at / speedup;
+			while(now() < due) {
+				waitUntil(due);
+				drain();
+			}
+			double lag = now() - due;
+			maxLag = max(maxLag, lag);
+			totalLag += lag;
+		} else if(i % MAX_BURST == 0) {
+			drain();
+		}
+		Client & c = clients[d.client];
+		double sentAt = now();
+		prepare(c, d.data, sentAt);
+		while(sendto(c.sock, d.data.data(), d.data.size(), 0, server->ai_addr, server->ai_addrlen) == -1) {
+			if(errno != ENOBUFS && errno != EAGAIN) {
+				perror("sendto");
+				break;
+			}
+		}
+		++sent;
+	}
+	double sendElapsed = now() - start;
+
+	double settle = now() + linger;
+	while(now() < settle) {
+		waitUntil(settle);
+		drain();
+	}
+	for(size_t i = 0; i < clients.size(); ++i) {
+		unanswered += clients[i].pending.size();
+		close(clients[i].sock);
+	}
+
+	sort(latencies.begin(), latencies.end());
+	printf("sent %ld datagrams in %.3f s (%.0f/s)", sent, sendElapsed, sendElapsed > 0 ? sent / sendElapsed : 0.0);
+	if(speedup > 0) {
+		printf(", %.1fx captured speed; schedule lag avg %.3f ms, max %.3f ms\n",
+			speedup, 1e3 * totalLag / sent, 1e3 * maxLag);
+	} else {
+		printf(", flat out\n");
+	}
+	printf("received %ld datagrams (%.0f/s)\n", received, sendElapsed > 0 ? received / sendElapsed : 0.0);
+	printf("replies %lu matched, %ld unanswered", (unsigned long) latencies.size(), unanswered);
+	if(tokenMisses > 0) {
+		printf(", %ld session tokens not remapped", tokenMisses);
+	}
+	putchar('\n');
+	if(!latencies.empty()) {
+		printf("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+			1e3 * percentile(latencies, 0.5), 1e3 * percentile(latencies, 0.9),
+			1e3 * percentile(latencies, 0.99), 1e3 * latencies.back());
+	}
+	freeaddrinfo(server);
+	return 0;
+}
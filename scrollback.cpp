@@ -0,0 +1,227 @@
+/*
+ *	scrollback.cpp
+ *	Memory-bounded message history for the DuckChat client.
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "scrollback.h"
+
+// Each record is a packed header followed by the text:
+//   kind (1) | text length (1) | channel id (4) | user id (4) | text
+static const size_t RECORD_HEADER = 10;
+
+// Rough per-name overhead of the vector entry and the map node.
+static const size_t NAME_OVERHEAD = 96;
+
+ScrollbackFilter::ScrollbackFilter() : channel(Scrollback::NO_NAME) {}
+
+bool ScrollbackFilter::active() const {
+	return channel != Scrollback::NO_NAME || !substring.empty();
+}
+
+static size_t boundedLength(const char * s, size_t max) {
+	const char * end = (const char *) memchr(s, '\0', max);
+	return end == NULL ? max : end - s;
+}
+
+static bool contains(const char * hay, size_t hayLen, const std::string & needle) {
+	return std::search(hay, hay + hayLen, needle.begin(), needle.end()) != hay + hayLen;
+}
+
+bool ScrollbackFilter::matches(const Scrollback & sb, const ScrollbackLine & line) const {
+	if(channel != Scrollback::NO_NAME && line.channel != channel) {
+		return false;
+	}
+	if(substring.empty()) {
+		return true;
+	}
+	if(contains(line.text, line.textLen, substring)) {
+		return true;
+	}
+	if(line.user != Scrollback::NO_NAME) {
+		const char * name = sb.nameOf(line.user);
+		if(contains(name, strlen(name), substring)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+Scrollback::Scrollback(size_t memoryCap) : nameBytes(0), cap(memoryCap), nextLine(0) {
+	// Always keep room for at least two chunks so a fresh line never evicts
+	// the one just before it.
+	if(cap < 2 * sizeof(Chunk)) {
+		cap = 2 * sizeof(Chunk);
+	}
+}
+
+Scrollback::~Scrollback() {
+	for(std::deque<Chunk *>::iterator it = chunks.begin(); it != chunks.end(); ++it) {
+		delete *it;
+	}
+}
+
+uint32_t Scrollback::intern(const char * name, size_t maxLen) {
+	std::string key(name, boundedLength(name, maxLen));
+	std::map<std::string, uint32_t>::iterator it = nameIds.find(key);
+	if(it != nameIds.end()) {
+		return (*it).second;
+	}
+	uint32_t id = names.size();
+	names.push_back(key);
+	nameIds[key] = id;
+	nameBytes += key.size() + 1 + NAME_OVERHEAD;
+	enforceCap();
+	return id;
+}
+
+uint32_t Scrollback::lookup(const char * name, size_t maxLen) const {
+	std::string key(name, boundedLength(name, maxLen));
+	std::map<std::string, uint32_t>::const_iterator it = nameIds.find(key);
+	if(it == nameIds.end()) {
+		return NO_NAME;
+	}
+	return (*it).second;
+}
+
+const char * Scrollback::nameOf(uint32_t id) const {
+	if(id >= names.size()) {
+		return "";
+	}
+	return names[id].c_str();
+}
+
+void Scrollback::append(LineKind kind, uint32_t channel, uint32_t user, const char * text, size_t textLen) {
+	if(textLen > MAX_TEXT) {
+		textLen = MAX_TEXT;
+	}
+	const size_t recordSize = RECORD_HEADER + textLen;
+	Chunk * c = chunks.empty() ? NULL : chunks.back();
+	if(c == NULL || c->used + recordSize > CHUNK_DATA || c->count == sizeof(c->offsets) / sizeof(c->offsets[0])) {
+		c = new Chunk;
+		c->firstLine = nextLine;
+		c->count = 0;
+		c->used = 0;
+		chunks.push_back(c);
+		enforceCap();
+	}
+	char * rec = c->data + c->used;
+	uint8_t k = kind;
+	uint8_t len = textLen;
+	rec[0] = k;
+	rec[1] = len;
+	memcpy(rec + 2, &channel, 4);
+	memcpy(rec + 6, &user, 4);
+	memcpy(rec + RECORD_HEADER, text, textLen);
+	c->offsets[c->count++] = c->used;
+	c->used += recordSize;
+	++nextLine;
+}
+
+void Scrollback::enforceCap() {
+	while(chunks.size() > 1 && memoryUsed() > cap) {
+		delete chunks.front();
+		chunks.pop_front();
+	}
+}
+
+uint64_t Scrollback::firstLine() const {
+	return chunks.empty() ? nextLine : chunks.front()->firstLine;
+}
+
+uint64_t Scrollback::endLine() const {
+	return nextLine;
+}
+
+// Chunks hold consecutive line ranges, so a binary search on firstLine finds
+// the owner of line n.  The caller guarantees firstLine() <= n < endLine().
+size_t Scrollback::chunkIndexFor(uint64_t n) const {
+	size_t lo = 0, hi = chunks.size() - 1;
+	while(lo < hi) {
+		size_t mid = (lo + hi + 1) / 2;
+		if(chunks[mid]->firstLine <= n) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+void Scrollback::decode(const Chunk * c, int i, ScrollbackLine & out) {
+	const char * rec = c->data + c->offsets[i];
+	out.kind = (LineKind) (uint8_t) rec[0];
+	out.textLen = (uint8_t) rec[1];
+	memcpy(&out.channel, rec + 2, 4);
+	memcpy(&out.user, rec + 6, 4);
+	out.text = rec + RECORD_HEADER;
+}
+
+bool Scrollback::get(uint64_t n, ScrollbackLine & out) const {
+	if(n < firstLine() || n >= endLine()) {
+		return false;
+	}
+	const Chunk * c = chunks[chunkIndexFor(n)];
+	decode(c, n - c->firstLine, out);
+	return true;
+}
+
+bool Scrollback::findPrev(uint64_t before, const ScrollbackFilter & filter, uint64_t & found) const {
+	if(before > endLine()) {
+		before = endLine();
+	}
+	if(before <= firstLine()) {
+		return false;
+	}
+	ScrollbackLine line;
+	size_t ci = chunkIndexFor(before - 1);
+	int i = before - 1 - chunks[ci]->firstLine;
+	while(true) {
+		const Chunk * c = chunks[ci];
+		for(; i >= 0; --i) {
+			decode(c, i, line);
+			if(filter.matches(*this, line)) {
+				found = c->firstLine + i;
+				return true;
+			}
+		}
+		if(ci == 0) {
+			return false;
+		}
+		--ci;
+		i = chunks[ci]->count - 1;
+	}
+}
+
+bool Scrollback::findNext(uint64_t from, const ScrollbackFilter & filter, uint64_t & found) const {
+	if(from < firstLine()) {
+		from = firstLine();
+	}
+	if(from >= endLine()) {
+		return false;
+	}
+	ScrollbackLine line;
+	size_t ci = chunkIndexFor(from);
+	int i = from - chunks[ci]->firstLine;
+	for(; ci < chunks.size(); ++ci, i = 0) {
+		const Chunk * c = chunks[ci];
+		for(; i < c->count; ++i) {
+			decode(c, i, line);
+			if(filter.matches(*this, line)) {
+				found = c->firstLine + i;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+size_t Scrollback::memoryUsed() const {
+	return chunks.size() * sizeof(Chunk) + nameBytes;
+}
+
+size_t Scrollback::memoryCap() const {
+	return cap;
+}
@@ -0,0 +1,107 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+/*
+ *	scrollback.h
+ *	Memory-bounded message history for the DuckChat client.
+ *
+ *	Lines are packed back to back into fixed-size chunks.  Channel and user
+ *	names are interned once and referenced by a 32-bit id, so a say line costs
+ *	a 10 byte header plus its text.  When the total footprint would exceed the
+ *	memory cap, the oldest chunk is dropped.  Lines are numbered from 0 in
+ *	arrival order; the numbers stay valid after eviction, and
+ *	firstLine()..endLine() is the range still available.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+enum LineKind {
+	LINE_SAY,			// [channel][user]: text
+	LINE_ERROR,			// Error: text
+	LINE_WARN,			// Warning: text
+	LINE_INFO,			// text
+	LINE_LIST_HEADER,	// Existing channels:
+	LINE_CHANNEL,		// 	channel
+	LINE_WHO_HEADER,	// Users on channel channel:
+	LINE_USER,			// 	user
+	LINE_JOINED,		// [channel] user joined
+	LINE_LEFT			// [channel] user left
+};
+
+struct ScrollbackLine {
+	LineKind kind;
+	uint32_t channel;	// Interned id, or Scrollback::NO_NAME
+	uint32_t user;		// Interned id, or Scrollback::NO_NAME
+	const char * text;	// Not NUL-terminated
+	size_t textLen;
+};
+
+class Scrollback;
+
+// Restricts which lines are shown: by channel, by substring, or both.
+struct ScrollbackFilter {
+	uint32_t channel;
+	std::string substring;
+
+	ScrollbackFilter();
+	bool active() const;
+	bool matches(const Scrollback & sb, const ScrollbackLine & line) const;
+};
+
+class Scrollback {
+public:
+	static const uint32_t NO_NAME = 0xffffffff;
+	static const size_t CHUNK_DATA = 16384;
+	static const size_t MAX_TEXT = 255;
+
+	Scrollback(size_t memoryCap);
+	~Scrollback();
+
+	uint32_t intern(const char * name, size_t maxLen);
+	uint32_t lookup(const char * name, size_t maxLen) const;
+	const char * nameOf(uint32_t id) const;
+
+	void append(LineKind kind, uint32_t channel, uint32_t user, const char * text, size_t textLen);
+
+	uint64_t firstLine() const;
+	uint64_t endLine() const;
+	bool get(uint64_t n, ScrollbackLine & out) const;
+
+	// Search backwards from line `before` (exclusive) / forwards from line
+	// `from` (inclusive) for a line that passes the filter.
+	bool findPrev(uint64_t before, const ScrollbackFilter & filter, uint64_t & found) const;
+	bool findNext(uint64_t from, const ScrollbackFilter & filter, uint64_t & found) const;
+
+	size_t memoryUsed() const;
+	size_t memoryCap() const;
+
+private:
+	struct Chunk {
+		uint64_t firstLine;
+		uint16_t count;
+		uint16_t used;
+		uint16_t offsets[CHUNK_DATA / 10];
+		char data[CHUNK_DATA];
+	};
+
+	std::deque<Chunk *> chunks;
+	std::vector<std::string> names;
+	std::map<std::string, uint32_t> nameIds;
+	size_t nameBytes;
+	size_t cap;
+	uint64_t nextLine;
+
+	size_t chunkIndexFor(uint64_t n) const;
+	static void decode(const Chunk * c, int i, ScrollbackLine & out);
+	void enforceCap();
+
+	Scrollback(const Scrollback &);
+	Scrollback & operator=(const Scrollback &);
+};
+
+#endif
@@ -6,7 +6,7 @@
 #include <set>
 #include <map>
 #include <vector>
-#include <list>
+#include <deque>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -14,19 +14,55 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/sock_diag.h>
+#endif
 
 #include "duckchat.h"
+#include "namerecord.h"
+#include "sessionstore.h"
+#include "spscqueue.h"
+#include "capture.h"
+#include "egress.h"
+#include "uringio.h"
 
 using namespace std;
 
-class User;
 class Channel;
+struct Shard;
 
 void timerExpired(int signum);
+void expireIdleUsers();
 
-const int MAX_NUM_CHANNELS = 32;
-const int MAX_NUM_USERS = 32;
+const int DEFAULT_MAX_CHANNELS = 32;
+const int DEFAULT_MAX_CHANNEL_USERS = 32;
+const size_t DEFAULT_MAX_SESSIONS = 1 << 20;
 const int KEEP_ALIVE_DELAY = 60;
+const int MAX_SHARDS = 64;
+const size_t SHARD_QUEUE_SIZE = 8192;	// Requests waiting for a channel shard
+const size_t EGRESS_QUEUE_SIZE = 65536;	// Datagrams waiting for a shard's sender
+const int EGRESS_POLL_MS = 5;			// Longest a backlogged sender waits before taking new jobs
+const size_t MAX_REQUEST_SIZE = sizeof(request_join_many) + JOIN_MANY_MAX * CHANNEL_MAX;
+const size_t MAX_DATAGRAM = 65507;		// Largest UDP payload over IPv4
+const size_t WHO_MAX_NAMES = (MAX_DATAGRAM - sizeof(text_who)) / sizeof(user_info);
+const size_t LIST_MAX_NAMES = (MAX_DATAGRAM - sizeof(text_list)) / sizeof(channel_info);
+const int PRESENCE_BATCH_MAX = 16;		// Changes per TXT_PRESENCE datagram
+const int PRESENCE_FLUSH_OPS = 256;		// Requests a burst may run before deltas go out anyway
+const int LOAD_SAMPLE_REQUESTS = 32;	// Requests between samples of the overload gauge
+const int OVERLOAD_ENTER = 50;			// Gauge (percent) at which shedding starts
+const int OVERLOAD_EXIT = 25;			// Gauge at which it stops again
+const double SHED_HOLD = 1.0;			// Seconds shedding lasts after the gauge last hit OVERLOAD_ENTER
+const size_t MAX_DEFERRED = 256;		// WHO/LIST requests held back while shedding
+const double SHED_SAY_RATE = 5;			// Says per second per user while shedding
+const double SHED_SAY_BURST = 10;
+const int EXPIRY_GRACE_PERIODS = 2;		// Keep-alive periods a user may miss after packet loss
+const size_t DEFAULT_MULTICAST_THRESHOLD = 8;	// Members at which a channel goes multicast (-m)
+const uint32_t MULTICAST_GROUPS = 4096;		// Consecutive groups handed out from the -m base
 
 static inline size_t strnlen(const char *s, size_t max) {
     register const char *p;
@@ -34,39 +70,158 @@ static inline size_t strnlen(const char *s, size_t max) {
     return(p - s);
 }
 
-class User {
-public:
-	string name;
-	string key;
-	struct sockaddr_storage * address;
-	list<Channel *> channels;
-	bool seen;
-	
-	User(const string n, const string k, struct sockaddr_storage * a) : name(n), key(k), address(a), seen(true) {};
-	
-	virtual ~User() {
-		delete address;
-	};
+// A membership change waiting to be pushed to a channel's subscribers.
+struct PendingPresence {
+	NameRecord name;
+	bool joined;
 };
 
 class Channel {
 public:
-	string name;
-	list<User *> users;
+	NameRecord name;
+	Shard * shard;				// Owner
+	vector<UserHandle> users;
+	vector<UserHandle> subscribers;	// Members that asked for presence deltas
+	vector<PendingPresence> pendingPresence;
+	bool presenceDirty;			// On its shard's dirtyChannels list
+	uint32_t group;				// Multicast group for says (network order), 0 for unicast
+	vector<uint8_t> acked;		// Parallel to users: member confirmed the group
+	size_t numAcked;
 	
-	Channel(const string n) : name(n) {};
+	Channel(const NameRecord & n, Shard * s) : name(n), shard(s), presenceDirty(false), group(0), numAcked(0) {};
 	
 	virtual ~Channel() {}; 
 };
 
 
-map<string, User *> users;
-map<string, Channel *> channels;
+// A datagram waiting for an egress thread.
+struct SendJob {
+	struct sockaddr_storage address;
+	socklen_t addrLen;
+	Packet * pkt;
+};
+
+// A channel request routed from the ingress thread to the shard that owns
+// the channel.  OP_PURGE_USER removes a logged-out user from every channel
+// the shard owns.  REQ_PRESENCE becomes OP_SUBSCRIBE or OP_UNSUBSCRIBE.
+// OP_JOIN_MANY carries the shard's share of a REQ_JOIN_MANY in batch, which
+// the shard frees.
+const int OP_PURGE_USER = -1;
+const int OP_SUBSCRIBE = -2;
+const int OP_UNSUBSCRIBE = -3;
+const int OP_JOIN_MANY = -4;
+
+struct ShardOp {
+	int type;
+	UserHandle user;
+	NameRecord channel;
+	char text[SAY_MAX];
+	NameRecord * batch;
+	int batchSize;
+};
+
+// Channels are partitioned into shards by a hash of their name.  Without -p
+// there is a single shard, run inline by the main thread, with no queues.
+// With -p N each shard has a worker thread that owns its channels and a
+// sender thread that drains its egress queue into an Egress of its own.
+// The channel map itself is
+// only written by the owner, under channelsLock, so the ingress thread can
+// read names for REQ_LIST.
+struct Shard {
+	int id;
+	map<NameRecord, Channel *> channels;
+	pthread_mutex_t channelsLock;
+	SpscQueue<ShardOp> * inbox;
+	SpscQueue<SendJob> * outbox;
+	Egress * egress;
+	pthread_t worker;
+	pthread_t sender;
+	unsigned long inboxDrops;
+	unsigned long outboxStalls;
+	vector<Channel *> dirtyChannels;	// Channels with presence deltas to push
+	int opsSinceFlush;
+	unsigned long multicastSays;		// Says sent to a group
+	unsigned long unicastsAvoided;		// Member copies those saved
+};
+
+SessionStore users;
+size_t maxSessions = DEFAULT_MAX_SESSIONS;
+int maxChannels = DEFAULT_MAX_CHANNELS;
+int maxChannelUsers = DEFAULT_MAX_CHANNEL_USERS;
+
+// Multicast fan-out (-m).  Once a channel has multicastThreshold members its
+// says go to a group of its own, sent once, and members that confirmed the
+// group get no unicast copy.  It drops back to unicast below half that.
+bool multicastEnabled = false;
+uint32_t multicastBase;			// Host order
+uint16_t multicastPort;			// Network order
+size_t multicastThreshold = DEFAULT_MULTICAST_THRESHOLD;
+uint32_t nextGroup = 0;
+int randomFd = -1;
+vector<Shard *> shards;
+bool pipelined = false;
+int numChannels = 0;	// Live channels across all shards
+
+// The shard whose channels the current thread may touch.  NULL on the
+// ingress thread when pipelined.
+__thread Shard * myShard = NULL;
+
+volatile sig_atomic_t timerFired = 0;
+volatile sig_atomic_t stopRequested = 0;
+
+const NameRecord commonName("Common");
+
+// Overload state, only touched by the ingress thread.  The gauge is how full
+// the socket's receive buffer is, or the fullest shard inbox when pipelined.
+// While shedding, session requests always go through, WHO and LIST wait
+// until the backlog clears and each user's says are rate limited.
+struct LoadState {
+	int gauge;
+	bool shedding;
+	double shedUntil;
+	int sinceSample;
+	unsigned long kernelDrops;		// Datagrams the kernel dropped (SO_RXQ_OVFL)
+	unsigned long dropsAtSample;
+	unsigned long dropsAtExpiry;
+	bool sheddingThisPeriod;
+	unsigned long episodes;
+	unsigned long deferred;
+	unsigned long shedWho;
+	unsigned long shedList;
+	unsigned long shedSay;
+	unsigned long shedUnknown;
+};
+LoadState load;
+
+// A WHO or LIST held back while shedding.  The user may have logged out
+// before it runs, which the handle's generation will show.
+struct DeferredRequest {
+	int type;
+	UserHandle user;
+	NameRecord channel;
+};
+deque<DeferredRequest> deferredRequests;
+
+void sendError(UserHandle user, string msg);
+void notePresence(Channel * channel, UserHandle user, bool joined);
+void multicastJoined(Channel * channel, UserHandle user);
+void multicastLeft(Channel * channel);
+void forgetPresence(Channel * channel);
 
-void sendError(User * user, string msg);
+Shard * shardFor(const NameRecord & channelName) {
+	return shards[channelName.hash() % shards.size()];
+}
 
-bool isUserInChannel(User * user, Channel * channel) {
-	if(user == NULL) {
+Channel * findChannel(const NameRecord & name) {
+	map<NameRecord, Channel *>::iterator it = myShard->channels.find(name);
+	if(it == myShard->channels.end()) {
+		return NULL;
+	}
+	return (*it).second;
+}
+
+bool isUserInChannel(UserHandle user, Channel * channel) {
+	if(user == NO_USER) {
 		cerr << "User was null!" << endl;
 		return false;
 	}
@@ -74,62 +229,92 @@ bool isUserInChannel(User * user, Channel * channel) {
 		cerr << "Channel was null!" << endl;
 		return false;
 	}
-	list<User *>::iterator it = find(channel->users.begin(), channel->users.end(), user);
-	if(it == channel->users.end()) {
-		return false;
-	} else {
-		return true;
-	}
+	return users.isMember(user, channel);
 }
 
-void addUserToChannel(User * user, Channel * channel) {
-	if(user == NULL) {
-		cerr << "User was null!" << endl;
-		return;
-	}
-	if(channel == NULL) {
-		cerr << "Channel was null!" << endl;
-		return;
-	}
+// Returns one of the JOIN_* outcomes; reporting it is up to the caller.
+int addUserToChannel(UserHandle user, Channel * channel) {
 	if(isUserInChannel(user, channel)) {
-		sendError(user, "Already in that channel!");
-		return;
+		return JOIN_ALREADY_MEMBER;
 	}
-	if(channel->users.size() > MAX_NUM_USERS) {
-		sendError(user, "Channel is full!");
-		return;
+	if(channel->users.size() >= maxChannelUsers) {
+		return JOIN_CHANNEL_FULL;
 	}
-	user->channels.push_back(channel);
+	users.addMembership(user, channel);
 	channel->users.push_back(user);
-	cout << "User " << user->name << " added to channel " << channel->name << endl;
+	channel->acked.push_back(0);
+	notePresence(channel, user, true);
+	multicastJoined(channel, user);
+	cout << "User " << users.name(user) << " added to channel " << channel->name << endl;
+	return JOIN_OK;
 }
 
-void addUserToChannelNamed(User * user, string name) {
-	if(user == NULL) {
+// Joins a channel, creating it if need be.  Returns a JOIN_* outcome.
+int joinChannel(UserHandle user, const NameRecord & name) {
+	Channel * channel = findChannel(name);
+	if(channel == NULL) {
+		if(__atomic_load_n(&numChannels, __ATOMIC_RELAXED) >= maxChannels) {
+			return JOIN_TOO_MANY_CHANNELS;
+		}
+		channel = new Channel(name, myShard);
+		pthread_mutex_lock(&myShard->channelsLock);
+		myShard->channels[name] = channel;
+		pthread_mutex_unlock(&myShard->channelsLock);
+		__atomic_add_fetch(&numChannels, 1, __ATOMIC_RELAXED);
+	}
+	return addUserToChannel(user, channel);
+}
+
+void addUserToChannelNamed(UserHandle user, const NameRecord & name) {
+	if(user == NO_USER) {
 		cerr << "User was null!" << endl;
 		return;
 	}
-	
-	map<string, Channel *>::iterator it = channels.find(name);
-	if(it == channels.end() || (*it).second == NULL) {
-		int n = 0;
-		for(map<string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it) {
-			Channel * ch = (*it).second;
-			if(ch != NULL) {
-				n++;
-			}
-		}
-		if(n > MAX_NUM_CHANNELS) {
+	switch(joinChannel(user, name)) {
+		case JOIN_ALREADY_MEMBER:
+			sendError(user, "Already in that channel!");
+			break;
+		case JOIN_CHANNEL_FULL:
+			sendError(user, "Channel is full!");
+			break;
+		case JOIN_TOO_MANY_CHANNELS:
 			sendError(user, "Too many channels!");
-			return;
-		}
-		channels[name] = new Channel(name);
+			break;
+	}
+}
+
+static void eraseHandle(vector<UserHandle> & v, UserHandle user) {
+	vector<UserHandle>::iterator it = find(v.begin(), v.end(), user);
+	if(it != v.end()) {
+		v.erase(it);
+	}
+}
+
+// Takes a user out of a channel's member and subscriber lists.
+static void eraseMember(Channel * channel, UserHandle user) {
+	vector<UserHandle>::iterator it = find(channel->users.begin(), channel->users.end(), user);
+	if(it != channel->users.end()) {
+		size_t i = it - channel->users.begin();
+		channel->numAcked -= channel->acked[i];
+		channel->acked.erase(channel->acked.begin() + i);
+		channel->users.erase(it);
 	}
-	addUserToChannel(user, channels[name]);
+	eraseHandle(channel->subscribers, user);
 }
 
-void removeUserFromChannel(User * user, Channel * channel) {
-	if(user == NULL) {
+// Drops a channel nobody is in any more.
+void deleteChannel(Channel * channel) {
+	cout << "Removing channel " << channel->name << " because it has no users" << endl;
+	forgetPresence(channel);
+	pthread_mutex_lock(&myShard->channelsLock);
+	myShard->channels.erase(channel->name);
+	pthread_mutex_unlock(&myShard->channelsLock);
+	__atomic_sub_fetch(&numChannels, 1, __ATOMIC_RELAXED);
+	delete channel;
+}
+
+void removeUserFromChannel(UserHandle user, Channel * channel) {
+	if(user == NO_USER) {
 		cerr << "User was null!" << endl;
 		return;
 	}
@@ -142,90 +327,258 @@ void removeUserFromChannel(User * user, Channel * channel) {
 		sendError(user, "Not in that channel!");
 		return;
 	}
-	if(channel->name.compare("Common") == 0) {
+	if(channel->name == commonName) {
 		sendError(user, "You can't leave Common!");
 		return;
 	}
-	user->channels.remove(channel);
-	channel->users.remove(user);
-	cout << "User " << user->name << " removed from channel " << channel->name << endl;
+	users.removeMembership(user, channel);
+	eraseMember(channel, user);
+	notePresence(channel, user, false);
+	multicastLeft(channel);
+	cout << "User " << users.name(user) << " removed from channel " << channel->name << endl;
 	if(channel->users.empty()) {
-		cout << "Removing channel " << channel->name << " because it has no users" << endl;
-		channels[channel->name] = NULL;
-		delete channel;
+		deleteChannel(channel);
 	}
 }
 
-void removeUserFromChannelNamed(User * user, string name) {
-	if(user == NULL) {
+void removeUserFromChannelNamed(UserHandle user, const NameRecord & name) {
+	if(user == NO_USER) {
 		cerr << "User was null!" << endl;
 		return;
 	}
 	
-	map<string, Channel *>::iterator it = channels.find(name);
-	if(it == channels.end() || (*it).second == NULL) {
+	Channel * channel = findChannel(name);
+	if(channel == NULL) {
 		sendError(user, "Can't leave a nonexistent channel");
 	} else {
-		removeUserFromChannel(user, channels[name]);
+		removeUserFromChannel(user, channel);
 	}
 }
 
+static bool ownedByMyShard(const Channel * channel) {
+	return channel->shard == myShard;
+}
 
-void removeUserFromAllChannels(User * user) {
-	if(user == NULL) {
+// Removes the user from every channel owned by the current thread's shard.
+// Only the user's own memberships are visited, not every channel.
+void removeUserFromAllChannels(UserHandle user) {
+	if(user == NO_USER) {
 		cerr << "User was null!" << endl;
 		return;
 	}	
-	cout << "Removing user " << user->name << " from all channels. " << endl;
-	for(map<string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it) {
-		Channel * ch = (*it).second;
-		if(ch != NULL) {
-			ch->users.remove(user);
-			cout << "User " << user->name << " removed from channel " << ch->name << endl;
-		}
+	cout << "Removing user " << users.name(user) << " from all channels. " << endl;
+	vector<Channel *> left;
+	users.takeMemberships(user, ownedByMyShard, left);
+	for(size_t i = 0; i < left.size(); ++i) {
+		Channel * ch = left[i];
+		eraseMember(ch, user);
+		notePresence(ch, user, false);
+		multicastLeft(ch);
+		cout << "User " << users.name(user) << " removed from channel " << ch->name << endl;
 	}
-	user->channels.clear();
 }
 
 
 int sock;
 struct addrinfo *p;
+UringSocket * uring = NULL;	// Set when running with the io_uring backend (-u)
+Egress * egress = NULL;		// The main thread's sends, unless io_uring has them
+CaptureWriter * capture = NULL;	// Set when recording inbound traffic (-c)
+
+size_t addressLength(const struct sockaddr_storage * address) {
+	if(address->ss_family == AF_INET) {
+		return sizeof(sockaddr);
+	} else {
+		return sizeof(sockaddr_in6);
+	}
+}
 
-void sendError(User * user, string msg) {
+// Hands a datagram to the current shard's egress thread.  The shard waits
+// for room rather than dropping: only its own channels are held up.
+void queueSendTo(const struct sockaddr_storage * address, socklen_t addrLen, Packet * pkt) {
+	SendJob job;
+	memcpy(&job.address, address, addrLen);
+	job.addrLen = addrLen;
+	job.pkt = pkt;
+	retainPacket(pkt);
+	if(!myShard->outbox->push(job)) {
+		++myShard->outboxStalls;
+		do {
+			myShard->outbox->notify();
+			sched_yield();
+		} while(!myShard->outbox->push(job));
+	}
+	myShard->outbox->notify();
+}
+
+void queueSend(UserHandle user, Packet * pkt) {
+	struct sockaddr_storage address;
+	socklen_t addrLen = users.address(user, &address);
+	queueSendTo(&address, addrLen, pkt);
+}
+
+// Sends a datagram from the main thread, either through its Egress (which
+// queues it if the socket is full) or by queueing it on the io_uring to be
+// submitted with the rest of this batch.
+int sendDatagram(const void * data, size_t len, const struct sockaddr_storage * address) {
+	if(uring != NULL) {
+		uring->send(data, len, (const sockaddr *) address, addressLength(address));
+		return len;
+	}
+	return egress->send(data, len, address, addressLength(address));
+}
+
+int sendDatagram(const void * data, size_t len, UserHandle user) {
+	struct sockaddr_storage address;
+	users.address(user, &address);
+	return sendDatagram(data, len, &address);
+}
+
+// Sends a response to one user: queued when running on a pipelined shard,
+// straight out of the socket otherwise.
+void sendToUser(UserHandle user, const void * data, size_t len, const char * what) {
+	if(myShard != NULL && myShard->outbox != NULL) {
+		Packet * pkt = newPacket(data, len);
+		queueSend(user, pkt);
+		releasePacket(pkt);
+		return;
+	}
+	int status = sendDatagram(data, len, user);
+	if(status == -1) {
+		perror(what);
+	}
+}
+
+void sendError(UserHandle user, string msg) {
 	cout << "Sending error: " << msg << endl;
-	if(user == NULL) {
+	if(user == NO_USER) {
 		cerr << "Tried to send error to unknown user" << endl;
 		return;
 	}
 	struct text_error pkt;
 	pkt.txt_type = htonl(TXT_ERROR);
 	strncpy(pkt.txt_error, msg.c_str(), SAY_MAX);
-	int status = -1;
-	size_t addrSize;
-	if(user->address->ss_family == AF_INET) {
-		addrSize = sizeof(sockaddr);
-	} else {
-		addrSize = sizeof(sockaddr_in6);
-	}
-	status = sendto(sock, &pkt, sizeof(text_error), 0, (sockaddr *) user->address, addrSize);
-	if(status == -1) {
+	sendToUser(user, &pkt, sizeof(text_error), "while sending error");
+}
+
+// For requests from an address that has no session (yet).
+void sendErrorTo(const struct sockaddr_storage * address, string msg) {
+	cout << "Sending error: " << msg << endl;
+	struct text_error pkt;
+	pkt.txt_type = htonl(TXT_ERROR);
+	strncpy(pkt.txt_error, msg.c_str(), SAY_MAX);
+	if(sendDatagram(&pkt, sizeof(text_error), address) == -1) {
 		perror("while sending error");
 	}
 }
 
-void logout(User * user) {
-	if(user == NULL) {
+// Logs a user out.  Pipelined, the user is unhooked from the session table
+// right away, so no later request can reach it, and every shard is sent a
+// purge behind whatever it already has queued for the user.  The last shard
+// to finish its purge frees the session's slot.
+void logout(UserHandle user) {
+	if(user == NO_USER) {
 		cerr << "Tried to log out an unknown user" << endl;
 		return;
 	}
 	
+	users.unlink(user);
+	if(pipelined) {
+		users.cold(user).pendingPurges = shards.size();
+		ShardOp op;
+		op.type = OP_PURGE_USER;
+		op.user = user;
+		for(size_t i = 0; i < shards.size(); ++i) {
+			while(!shards[i]->inbox->push(op)) {
+				shards[i]->inbox->notify();
+				sched_yield();
+			}
+			shards[i]->inbox->notify();
+		}
+		return;
+	}
 	removeUserFromAllChannels(user);
-	users[user->key] = NULL;
-	delete user;
+	users.release(user);
+}
+
+socklen_t groupAddress(const Channel * channel, struct sockaddr_storage * out) {
+	struct sockaddr_in * in = (struct sockaddr_in *) out;
+	memset(in, 0, sizeof(struct sockaddr_in));
+	in->sin_family = AF_INET;
+	in->sin_addr.s_addr = channel->group;
+	in->sin_port = multicastPort;
+	return sizeof(struct sockaddr_in);
+}
+
+void announceGroup(Channel * channel, UserHandle user) {
+	struct text_multicast pkt;
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.txt_type = htonl(TXT_MULTICAST);
+	channel->name.copyTo(pkt.txt_channel);
+	pkt.txt_group = channel->group;
+	pkt.txt_port = multicastPort;
+	sendToUser(user, &pkt, sizeof(text_multicast), "while announcing multicast group");
 }
 
-void say(User * user, Channel * channel, char * msg) {
-	if(user == NULL) {
+// Called after a user joins.  A channel that just reached the threshold
+// gets a group and every member is told; a channel that already has one
+// only needs to tell the newcomer.
+void multicastJoined(Channel * channel, UserHandle user) {
+	if(!multicastEnabled) {
+		return;
+	}
+	if(channel->group != 0) {
+		announceGroup(channel, user);
+		return;
+	}
+	if(channel->users.size() < multicastThreshold) {
+		return;
+	}
+	uint32_t n = __atomic_fetch_add(&nextGroup, 1, __ATOMIC_RELAXED) % MULTICAST_GROUPS;
+	channel->group = htonl(multicastBase + n);
+	struct in_addr group;
+	group.s_addr = channel->group;
+	cout << "Channel " << channel->name << " switching to multicast group " << inet_ntoa(group) << endl;
+	for(size_t i = 0; i < channel->users.size(); ++i) {
+		announceGroup(channel, channel->users[i]);
+	}
+}
+
+// Called after a user leaves.  Below half the threshold the channel goes
+// back to unicast; members are told so they can leave the group.
+void multicastLeft(Channel * channel) {
+	if(channel->group == 0 || channel->users.size() >= (multicastThreshold + 1) / 2) {
+		return;
+	}
+	cout << "Channel " << channel->name << " back to unicast" << endl;
+	channel->group = 0;
+	channel->numAcked = 0;
+	fill(channel->acked.begin(), channel->acked.end(), 0);
+	for(size_t i = 0; i < channel->users.size(); ++i) {
+		announceGroup(channel, channel->users[i]);
+	}
+}
+
+// A member has joined the channel's group.  An ack for a group the channel
+// has since given up is ignored.
+void multicastAck(UserHandle user, Channel * channel, uint32_t group) {
+	if(user == NO_USER || channel == NULL || channel->group == 0 || channel->group != group) {
+		return;
+	}
+	vector<UserHandle>::iterator it = find(channel->users.begin(), channel->users.end(), user);
+	if(it == channel->users.end()) {
+		return;
+	}
+	size_t i = it - channel->users.begin();
+	if(!channel->acked[i]) {
+		channel->acked[i] = 1;
+		++channel->numAcked;
+		cout << "User " << users.name(user) << " receiving " << channel->name << " by multicast" << endl;
+	}
+}
+
+void say(UserHandle user, Channel * channel, char * msg) {
+	if(user == NO_USER) {
 		cerr << "Unknown user tried to say something!" << endl;
 		return;
 	}
@@ -237,71 +590,87 @@ void say(User * user, Channel * channel, char * msg) {
 		sendError(user, "You aren't in that channel!");
 		return;
 	}
-	cout << "[" << channel->name << "][" << user->name << "]: " << msg << endl;
+	cout << "[" << channel->name << "][" << users.name(user) << "]: " << msg << endl;
 	struct text_say pkt;
 	pkt.txt_type = htonl(TXT_SAY);
-	strncpy(pkt.txt_channel, channel->name.c_str(), CHANNEL_MAX);
-	strncpy(pkt.txt_username, user->name.c_str(), USERNAME_MAX);
-	strncpy(pkt.txt_text, msg, SAY_MAX);
-	for(list<User *>::iterator it = channel->users.begin(); it != channel->users.end(); ++it) {
-		User * u = *it;
-		if(u != NULL) {
-			cerr << "sock: " << sock << ", pkt: " << &pkt << endl;
-			cerr << "user: " << u->key << endl;
-			size_t addrSize;
-			if(u->address->ss_family == AF_INET) {
-				addrSize = sizeof(sockaddr);
-			} else {
-				addrSize = sizeof(sockaddr_in6);
-			}
-			int status = sendto(sock, &pkt, sizeof(text_say), 0, (sockaddr *) u->address, addrSize);
-			if(status == -1) {
-				cerr << "When trying to send say to " << u->name << endl;
-				perror("while sending say");
+	channel->name.copyTo(pkt.txt_channel);
+	users.name(user).copyTo(pkt.txt_username);
+	memcpy(pkt.txt_text, msg, SAY_MAX);
+	// Members that confirmed the channel's group get the one multicast copy;
+	// everybody else still gets their own.
+	bool viaGroup = channel->numAcked > 0;
+	if(viaGroup) {
+		++myShard->multicastSays;
+		myShard->unicastsAvoided += channel->numAcked;
+	}
+	if(myShard->outbox != NULL) {
+		// One shared copy of the datagram for the whole fan-out.
+		Packet * shared = newPacket(&pkt, sizeof(text_say));
+		if(viaGroup) {
+			struct sockaddr_storage group;
+			queueSendTo(&group, groupAddress(channel, &group), shared);
+		}
+		for(size_t i = 0; i < channel->users.size(); ++i) {
+			if(!channel->acked[i]) {
+				queueSend(channel->users[i], shared);
 			}
 		}
+		releasePacket(shared);
+		return;
+	}
+	if(viaGroup) {
+		struct sockaddr_storage group;
+		groupAddress(channel, &group);
+		if(sendDatagram(&pkt, sizeof(text_say), &group) == -1) {
+			perror("while sending say to multicast group");
+		}
+	}
+	for(size_t i = 0; i < channel->users.size(); ++i) {
+		if(channel->acked[i]) {
+			continue;
+		}
+		UserHandle u = channel->users[i];
+		int status = sendDatagram(&pkt, sizeof(text_say), u);
+		if(status == -1) {
+			cerr << "When trying to send say to " << users.name(u) << endl;
+			perror("while sending say");
+		}
 	}
 }
 
-void listChannels(User * user) {
-	if(user == NULL) {
+// Channel names come from every shard, each read under its channelsLock.
+void listChannels(UserHandle user) {
+	if(user == NO_USER) {
 		cerr << "Tried to send channel list to unknown user" << endl;
 		return;
 	}
-	cout << "Sending channel list to " << user->name << endl;
-	list<Channel *> channelsToSend;
+	cout << "Sending channel list to " << users.name(user) << endl;
+	vector<NameRecord> channelsToSend;
 	int n = 0;
-	for(map<string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it) {
-		Channel * ch = (*it).second;
-		if(ch != NULL) {
-			channelsToSend.push_back(ch);
-			n++;
+	for(size_t s = 0; s < shards.size(); ++s) {
+		pthread_mutex_lock(&shards[s]->channelsLock);
+		for(map<NameRecord, Channel *>::iterator it = shards[s]->channels.begin(); it != shards[s]->channels.end() && n < LIST_MAX_NAMES; ++it) {
+			Channel * ch = (*it).second;
+			if(ch != NULL) {
+				channelsToSend.push_back(ch->name);
+				n++;
+			}
 		}
+		pthread_mutex_unlock(&shards[s]->channelsLock);
 	}
 	const size_t pktSize = sizeof(text_list) + (n * sizeof(channel_info));
 	struct text_list * pkt = (text_list *) malloc( pktSize );
-	memset(pkt, '\0', pktSize);
 	pkt->txt_type = htonl(TXT_LIST);
 	pkt->txt_nchannels = htonl(n);
-	int i = 0;
-	for(list<Channel *>::iterator it = channelsToSend.begin(); it != channelsToSend.end(); ++it) {
-		strncpy(pkt->txt_channels[i++].ch_channel, (*it)->name.c_str(), CHANNEL_MAX);
-	}
-	size_t addrSize;
-	if(user->address->ss_family == AF_INET) {
-		addrSize = sizeof(sockaddr);
-	} else {
-		addrSize = sizeof(sockaddr_in6);
-	}
-	int status = sendto(sock, pkt, pktSize, 0, (sockaddr *) user->address, addrSize);
-	if(status == -1) {
-		perror("while sending channel list");
+	for(int i = 0; i < n; ++i) {
+		channelsToSend[i].copyTo(pkt->txt_channels[i].ch_channel);
 	}
+	sendToUser(user, pkt, pktSize, "while sending channel list");
 	free(pkt);
 }
 
-void who(User * user, Channel * channel) {
-	if(user == NULL) {
+void who(UserHandle user, Channel * channel) {
+	if(user == NO_USER) {
 		cerr << "Tried to send who list to unknown user" << endl;
 		return;
 	}
@@ -309,58 +678,1004 @@ void who(User * user, Channel * channel) {
 		sendError(user, "You tried to show members of a nonexistent channel!");
 		return;
 	}
-	cout << "Sending who list to " << user->name << " for channel " << channel->name << endl;
-	int n = channel->users.size();
+	cout << "Sending who list to " << users.name(user) << " for channel " << channel->name << endl;
+	int n = min(channel->users.size(), WHO_MAX_NAMES);
 	const size_t pktSize = sizeof(text_who) + (n * sizeof(user_info));
 	struct text_who * pkt = (text_who *) malloc( pktSize );
-	memset(pkt, '\0', pktSize);
 	pkt->txt_type = htonl(TXT_WHO);
 	pkt->txt_nusernames = htonl(n);
-	strncpy(pkt->txt_channel, channel->name.c_str(), CHANNEL_MAX);
-	int i = 0;
-	for(list<User *>::iterator it = channel->users.begin(); it != channel->users.end(); ++it) {
-		strncpy(pkt->txt_users[i++].us_username, (*it)->name.c_str(), USERNAME_MAX);
-	}
-	size_t addrSize;
-	if(user->address->ss_family == AF_INET) {
-		addrSize = sizeof(sockaddr);
+	channel->name.copyTo(pkt->txt_channel);
+	for(int i = 0; i < n; ++i) {
+		users.name(channel->users[i]).copyTo(pkt->txt_users[i].us_username);
+	}
+	sendToUser(user, pkt, pktSize, "while sending who list");
+	free(pkt);
+}
+
+// Starts or stops pushing membership changes of a channel to a member.  A
+// new subscriber gets one full TXT_WHO snapshot to apply the deltas to.
+void subscribePresence(UserHandle user, Channel * channel, bool subscribe) {
+	if(user == NO_USER) {
+		cerr << "Unknown user tried to change a presence subscription" << endl;
+		return;
+	}
+	if(channel == NULL || !isUserInChannel(user, channel)) {
+		sendError(user, "You aren't in that channel!");
+		return;
+	}
+	eraseHandle(channel->subscribers, user);
+	if(subscribe) {
+		channel->subscribers.push_back(user);
+		cout << "User " << users.name(user) << " subscribed to presence on " << channel->name << endl;
+		who(user, channel);
 	} else {
-		addrSize = sizeof(sockaddr_in6);
+		cout << "User " << users.name(user) << " unsubscribed from presence on " << channel->name << endl;
 	}
-	int status = sendto(sock, pkt, pktSize, 0, (sockaddr *) user->address, addrSize);
-	if(status == -1) {
-		perror("while sending who list");
+}
+
+// Queues a join or part for the channel's subscribers.  A change that undoes
+// one still queued (a quick leave and rejoin) cancels it instead, so a burst
+// only carries the net difference.
+void notePresence(Channel * channel, UserHandle user, bool joined) {
+	if(channel->subscribers.empty()) {
+		return;
+	}
+	vector<PendingPresence> & pending = channel->pendingPresence;
+	for(size_t i = 0; i < pending.size(); ++i) {
+		if(pending[i].joined != joined && pending[i].name == users.name(user)) {
+			pending.erase(pending.begin() + i);
+			return;
+		}
 	}
+	PendingPresence change;
+	change.name = users.name(user);
+	change.joined = joined;
+	pending.push_back(change);
+	if(!channel->presenceDirty) {
+		channel->presenceDirty = true;
+		myShard->dirtyChannels.push_back(channel);
+	}
+}
+
+// Drops a channel that is about to be deleted from the flush list.
+void forgetPresence(Channel * channel) {
+	if(channel->presenceDirty) {
+		vector<Channel *> & dirty = myShard->dirtyChannels;
+		dirty.erase(remove(dirty.begin(), dirty.end(), channel), dirty.end());
+	}
+}
+
+// Pushes every queued delta on the current shard, PRESENCE_BATCH_MAX
+// changes to a datagram, sharing each datagram across the subscribers.
+void flushPresence() {
+	if(myShard == NULL) {
+		return;
+	}
+	myShard->opsSinceFlush = 0;
+	for(size_t c = 0; c < myShard->dirtyChannels.size(); ++c) {
+		Channel * channel = myShard->dirtyChannels[c];
+		vector<PendingPresence> & pending = channel->pendingPresence;
+		for(size_t first = 0; first < pending.size(); first += PRESENCE_BATCH_MAX) {
+			int n = min(pending.size() - first, (size_t) PRESENCE_BATCH_MAX);
+			const size_t pktSize = sizeof(text_presence) + (n * sizeof(presence_change));
+			struct text_presence * pkt = (text_presence *) malloc( pktSize );
+			pkt->txt_type = htonl(TXT_PRESENCE);
+			channel->name.copyTo(pkt->txt_channel);
+			pkt->txt_nchanges = htonl(n);
+			for(int i = 0; i < n; ++i) {
+				pending[first + i].name.copyTo(pkt->txt_changes[i].pc_username);
+				pkt->txt_changes[i].pc_joined = htonl(pending[first + i].joined ? 1 : 0);
+			}
+			if(myShard->outbox != NULL) {
+				Packet * shared = newPacket(pkt, pktSize);
+				for(size_t i = 0; i < channel->subscribers.size(); ++i) {
+					queueSend(channel->subscribers[i], shared);
+				}
+				releasePacket(shared);
+			} else {
+				for(size_t i = 0; i < channel->subscribers.size(); ++i) {
+					if(sendDatagram(pkt, pktSize, channel->subscribers[i]) == -1) {
+						perror("while sending presence");
+					}
+				}
+			}
+			free(pkt);
+		}
+		pending.clear();
+		channel->presenceDirty = false;
+	}
+	myShard->dirtyChannels.clear();
+}
+
+bool presencePending() {
+	return myShard != NULL && !myShard->dirtyChannels.empty();
+}
+
+// Applies a list of joins in one pass and answers with a single
+// TXT_JOIN_RESULT.
+void joinMany(UserHandle user, const NameRecord * names, int n) {
+	const size_t pktSize = sizeof(text_join_result) + (n * sizeof(join_result));
+	struct text_join_result * pkt = (text_join_result *) malloc( pktSize );
+	pkt->txt_type = htonl(TXT_JOIN_RESULT);
+	pkt->txt_nresults = htonl(n);
+	for(int i = 0; i < n; ++i) {
+		names[i].copyTo(pkt->txt_results[i].jr_channel);
+		pkt->txt_results[i].jr_status = htonl(joinChannel(user, names[i]));
+	}
+	sendToUser(user, pkt, pktSize, "while sending join results");
 	free(pkt);
 }
 
+// Runs a channel request against the current thread's shard.
+void runChannelOp(int type, UserHandle user, const NameRecord & chanName, char * text, NameRecord * batch = NULL, int batchSize = 0) {
+	switch(type) {
+		case REQ_JOIN:
+			addUserToChannelNamed(user, chanName);
+			break;
+		case REQ_LEAVE:
+			removeUserFromChannelNamed(user, chanName);
+			break;
+		case REQ_SAY:
+			say(user, findChannel(chanName), text);
+			break;
+		case REQ_WHO:
+			who(user, findChannel(chanName));
+			break;
+		case OP_SUBSCRIBE:
+		case OP_UNSUBSCRIBE:
+			subscribePresence(user, findChannel(chanName), type == OP_SUBSCRIBE);
+			break;
+		case REQ_MULTICAST_ACK: {
+			uint32_t group;
+			memcpy(&group, text, sizeof(group));
+			multicastAck(user, findChannel(chanName), group);
+			break;
+		}
+		case OP_JOIN_MANY:
+			joinMany(user, batch, batchSize);
+			delete [] batch;
+			break;
+		case OP_PURGE_USER:
+			removeUserFromAllChannels(user);
+			if(__atomic_sub_fetch(&users.cold(user).pendingPurges, 1, __ATOMIC_ACQ_REL) == 0) {
+				users.release(user);
+			}
+			break;
+	}
+	// Deltas normally go out when the burst ends; this bounds how long a
+	// burst that never lets up can hold them back.
+	if(presencePending() && ++myShard->opsSinceFlush >= PRESENCE_FLUSH_OPS) {
+		flushPresence();
+	}
+}
+
+// Sends a channel request to the shard that owns the channel, or runs it
+// right here when not pipelined.  A full shard inbox drops the request, as
+// the kernel would have, instead of stalling every other shard behind it.
+void routeChannelOp(int type, UserHandle user, const NameRecord & chanName, const char * text) {
+	if(!pipelined) {
+		char textCopy[SAY_MAX];
+		if(text != NULL) {
+			memcpy(textCopy, text, SAY_MAX);
+		}
+		runChannelOp(type, user, chanName, textCopy);
+		return;
+	}
+	ShardOp op;
+	op.type = type;
+	op.user = user;
+	op.channel = chanName;
+	op.batch = NULL;
+	if(text != NULL) {
+		memcpy(op.text, text, SAY_MAX);
+	}
+	Shard * shard = shardFor(chanName);
+	if(!shard->inbox->push(op)) {
+		++shard->inboxDrops;
+		cerr << "Shard " << shard->id << " is full, dropping request for channel " << chanName << endl;
+		return;
+	}
+	shard->inbox->notify();
+}
+
+// Applies a REQ_JOIN_MANY.  Pipelined, the names are split up by owning
+// shard and each shard handles (and answers for) its share in one op.
+void routeJoinMany(UserHandle user, const char (*channels)[CHANNEL_MAX], int n) {
+	if(user == NO_USER) {
+		cerr << "Unknown user tried to join channels" << endl;
+		return;
+	}
+	if(!pipelined) {
+		vector<NameRecord> names(n);
+		for(int i = 0; i < n; ++i) {
+			names[i].set(channels[i], CHANNEL_MAX);
+		}
+		joinMany(user, &names[0], n);
+		return;
+	}
+	vector< vector<NameRecord> > perShard(shards.size());
+	for(int i = 0; i < n; ++i) {
+		NameRecord name(channels[i], CHANNEL_MAX);
+		perShard[name.hash() % shards.size()].push_back(name);
+	}
+	for(size_t s = 0; s < shards.size(); ++s) {
+		if(perShard[s].empty()) {
+			continue;
+		}
+		ShardOp op;
+		op.type = OP_JOIN_MANY;
+		op.user = user;
+		op.batchSize = perShard[s].size();
+		op.batch = new NameRecord[op.batchSize];
+		copy(perShard[s].begin(), perShard[s].end(), op.batch);
+		if(!shards[s]->inbox->push(op)) {
+			++shards[s]->inboxDrops;
+			cerr << "Shard " << s << " is full, dropping " << op.batchSize << " joins" << endl;
+			delete [] op.batch;
+			continue;
+		}
+		shards[s]->inbox->notify();
+	}
+}
+
+void * shardWorker(void * arg) {
+	myShard = (Shard *) arg;
+	ShardOp op;
+	while(true) {
+		myShard->inbox->wait();
+		while(myShard->inbox->pop(op)) {
+			runChannelOp(op.type, op.user, op.channel, op.text, op.batch, op.batchSize);
+		}
+		flushPresence();
+	}
+	return NULL;
+}
+
+// Moves the shard's outgoing datagrams to the socket.  Jobs are taken off
+// the queue as fast as they come, whether or not the socket has room, so
+// the worker is never held up by a slow send; the Egress holds the
+// overflow.  While it has a backlog the sender wakes every EGRESS_POLL_MS
+// to pick up new jobs.
+void * shardSender(void * arg) {
+	Shard * shard = (Shard *) arg;
+	Egress * out = shard->egress;
+	SendJob job;
+	while(true) {
+		if(!out->pending()) {
+			shard->outbox->wait();
+		}
+		out->drain();
+		while(shard->outbox->pop(job)) {
+			if(out->send(job.pkt, &job.address, job.addrLen) == -1) {
+				perror("while sending from egress queue");
+			}
+			releasePacket(job.pkt);
+		}
+		if(out->pending()) {
+			out->waitWritable(EGRESS_POLL_MS);
+		}
+	}
+	return NULL;
+}
+
+Shard * newShard(int id) {
+	Shard * shard = new Shard;
+	shard->id = id;
+	pthread_mutex_init(&shard->channelsLock, NULL);
+	shard->inbox = NULL;
+	shard->outbox = NULL;
+	shard->egress = NULL;
+	shard->inboxDrops = 0;
+	shard->outboxStalls = 0;
+	shard->opsSinceFlush = 0;
+	shard->multicastSays = 0;
+	shard->unicastsAvoided = 0;
+	return shard;
+}
+
+// Creates the shards and, when pipelined, their worker and sender threads.
+// SIGALRM is blocked in the new threads so it always lands on the ingress
+// thread, which is the only one allowed to log users out.
+void startShards(int count) {
+	pipelined = count > 0;
+	if(!pipelined) {
+		shards.push_back(newShard(0));
+		myShard = shards[0];
+		return;
+	}
+	sigset_t alarmSet, oldSet;
+	sigemptyset(&alarmSet);
+	sigaddset(&alarmSet, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &alarmSet, &oldSet);
+	for(int i = 0; i < count; ++i) {
+		Shard * shard = newShard(i);
+		shard->inbox = new SpscQueue<ShardOp>(SHARD_QUEUE_SIZE);
+		shard->outbox = new SpscQueue<SendJob>(EGRESS_QUEUE_SIZE);
+		shard->egress = new Egress(sock);
+		shards.push_back(shard);
+		pthread_create(&shard->worker, NULL, shardWorker, shard);
+		pthread_create(&shard->sender, NULL, shardSender, shard);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+	cout << "Pipelined with " << count << " channel shards" << endl;
+}
+
+static double monotonicNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void runDeferredRequests() {
+	while(!deferredRequests.empty()) {
+		DeferredRequest & req = deferredRequests.front();
+		if(users.valid(req.user)) {
+			if(req.type == REQ_LIST) {
+				listChannels(req.user);
+			} else {
+				routeChannelOp(REQ_WHO, req.user, req.channel, NULL);
+			}
+		}
+		deferredRequests.pop_front();
+	}
+}
+
+// Shedding starts as soon as the gauge reaches OVERLOAD_ENTER, but only stops
+// once it is down to OVERLOAD_EXIT and has stayed below OVERLOAD_ENTER for
+// SHED_HOLD, so a server hovering at the threshold doesn't flap.
+void setLoadGauge(int gauge) {
+	load.gauge = gauge;
+	if(gauge >= OVERLOAD_ENTER) {
+		load.shedUntil = monotonicNow() + SHED_HOLD;
+		if(!load.shedding) {
+			load.shedding = true;
+			load.sheddingThisPeriod = true;
+			++load.episodes;
+			cerr << "Overloaded (backlog at " << gauge << "%), shedding WHO, LIST and excess says" << endl;
+		}
+	} else if(load.shedding && gauge <= OVERLOAD_EXIT && monotonicNow() >= load.shedUntil) {
+		load.shedding = false;
+		cerr << "Backlog cleared, running " << deferredRequests.size() << " deferred requests" << endl;
+		runDeferredRequests();
+	}
+}
+
+// Samples the gauge.  New kernel drops count as a full buffer even if it has
+// drained since, because that is what caused them.
+void sampleLoad() {
+	load.sinceSample = 0;
+	int gauge = 0;
+#if defined(SO_MEMINFO) && defined(__linux__)
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t memLen = sizeof(mem);
+	if(getsockopt(sock, SOL_SOCKET, SO_MEMINFO, mem, &memLen) == 0 && mem[SK_MEMINFO_RCVBUF] > 0) {
+		gauge = (int) (100ULL * mem[SK_MEMINFO_RMEM_ALLOC] / mem[SK_MEMINFO_RCVBUF]);
+	}
+#endif
+	if(pipelined) {
+		for(size_t i = 0; i < shards.size(); ++i) {
+			gauge = max(gauge, (int) (100 * shards[i]->inbox->depth() / shards[i]->inbox->capacity()));
+		}
+	}
+	if(uring != NULL) {
+		load.kernelDrops = uring->kernelDrops;
+	}
+	if(load.kernelDrops != load.dropsAtSample) {
+		gauge = max(gauge, OVERLOAD_ENTER);
+		load.dropsAtSample = load.kernelDrops;
+	}
+	setLoadGauge(gauge);
+}
+
+// Decides whether a request is worth handling while shedding.  Returns false
+// if it was deferred or dropped.
+bool admitUnderLoad(request * buf, int recvSize, UserHandle user) {
+	switch(buf->req_type) {
+		case REQ_LOGIN:
+		case REQ_LOGOUT:
+		case REQ_KEEP_ALIVE:
+			return true;
+	}
+	if(user == NO_USER) {
+		++load.shedUnknown;
+		return false;
+	}
+	switch(buf->req_type) {
+		case REQ_WHO:
+		case REQ_LIST:
+			if(deferredRequests.size() < MAX_DEFERRED && (buf->req_type == REQ_LIST || recvSize >= sizeof(request_who))) {
+				DeferredRequest req;
+				req.type = buf->req_type;
+				req.user = user;
+				if(req.type == REQ_WHO) {
+					req.channel.set(((request_who *) buf)->req_channel, CHANNEL_MAX);
+				}
+				deferredRequests.push_back(req);
+				++load.deferred;
+			} else if(buf->req_type == REQ_WHO) {
+				++load.shedWho;
+			} else {
+				++load.shedList;
+			}
+			return false;
+		case REQ_SAY: {
+			double now = monotonicNow();
+			SessionCold & c = users.cold(user);
+			c.sayTokens = min(SHED_SAY_BURST, c.sayTokens + (now - c.sayStamp) * SHED_SAY_RATE);
+			c.sayStamp = now;
+			if(c.sayTokens < 1) {
+				++load.shedSay;
+				return false;
+			}
+			c.sayTokens -= 1;
+			return true;
+		}
+	}
+	return true;
+}
+
+// Called when the socket is known to be empty: there is no backlog.
+void socketIdle() {
+	if(load.shedding) {
+		setLoadGauge(0);
+	}
+	flushPresence();
+}
+
+// Sleeps until a request arrives or whatever else the main loop is waiting
+// for may have happened: the end of shedding's hold time, or room in the
+// socket for the egress backlog.
+void waitForSocket() {
+	struct pollfd pfd;
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	int timeout = -1;
+	if(load.shedding) {
+		timeout = (int) ((load.shedUntil - monotonicNow()) * 1000) + 1;
+	}
+	if(egress->pending()) {
+		if(egress->wantsWritable()) {
+			pfd.events |= POLLOUT;
+		}
+		int delay = egress->retryDelay();
+		if(delay >= 0 && (timeout < 0 || delay < timeout)) {
+			timeout = delay;
+		}
+	}
+	poll(&pfd, 1, timeout);
+}
+
+// Reads one datagram, picking up the kernel's drop count on the way.
+int receiveDatagram(void * data, size_t len, int flags, struct sockaddr_storage * from) {
+	struct iovec iov;
+	iov.iov_base = data;
+	iov.iov_len = len;
+	char control[CMSG_SPACE(sizeof(uint32_t))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = from;
+	msg.msg_namelen = sizeof(sockaddr_storage);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	int recvSize = recvmsg(sock, &msg, flags);
+	if(recvSize == -1) {
+		return -1;
+	}
+#ifdef SO_RXQ_OVFL
+	for(struct cmsghdr * c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+		if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t drops;
+			memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+			load.kernelDrops = drops;
+		}
+	}
+#endif
+	return recvSize;
+}
+
+void logLoad() {
+	cout << "load: gauge " << load.gauge << "%" << (load.shedding ? " (shedding)" : "")
+		<< ", " << load.kernelDrops << " kernel drops, " << load.episodes << " overload episodes, "
+		<< load.deferred << " deferred, shed " << load.shedWho << " who " << load.shedList << " list "
+		<< load.shedSay << " say " << load.shedUnknown << " unknown" << endl;
+}
+
+// Totals over the main thread's Egress and the shards'.  The shards' counts
+// are read without locking, so they may be slightly behind.
+void logEgress() {
+	vector<Egress *> all;
+	if(uring == NULL) {
+		all.push_back(egress);
+	}
+	for(size_t i = 0; i < shards.size(); ++i) {
+		if(shards[i]->egress != NULL) {
+			all.push_back(shards[i]->egress);
+		}
+	}
+	unsigned long sent = 0, queued = 0, pushedBack = 0, droppedDestination = 0, droppedBacklog = 0, errors = 0;
+	size_t peak = 0;
+	for(size_t i = 0; i < all.size(); ++i) {
+		sent += all[i]->sent;
+		queued += all[i]->queued;
+		pushedBack += all[i]->pushedBack;
+		droppedDestination += all[i]->droppedDestination;
+		droppedBacklog += all[i]->droppedBacklog;
+		errors += all[i]->errors;
+		peak = max(peak, all[i]->peakBacklog);
+	}
+	cout << "egress: " << sent << " sent, " << queued << " queued, " << pushedBack << " push-backs, dropped "
+		<< droppedDestination << " destination full " << droppedBacklog << " backlog full, "
+		<< errors << " errors, peak backlog " << peak << endl;
+}
+
+// Only flags the expiry; the main loop does the work, outside signal context.
 void timerExpired(int signum) {
-	for(map<string, User *>::iterator it = users.begin(); it != users.end(); ++it) {
-		User * u = (*it).second;
-		if(u != NULL) {
-			if(!u->seen) {
-				cout << "Logging out user " << u->name << " due to inactivity" << endl;
+	timerFired = 1;
+}
+
+void stopSignalled(int signum) {
+	stopRequested = 1;
+}
+
+// A keep-alive may have been among the datagrams lost while overloaded, so
+// after a period with drops or shedding users get EXPIRY_GRACE_PERIODS more
+// periods before they are logged out.
+void expireIdleUsers() {
+	timerFired = 0;
+	bool lossy = load.sheddingThisPeriod || load.kernelDrops != load.dropsAtExpiry;
+	int allowedMisses = lossy ? EXPIRY_GRACE_PERIODS : 0;
+	for(size_t slot = 0; slot < users.slotLimit(); ++slot) {
+		UserHandle u = users.linkedAt(slot);
+		if(u != NO_USER && !users.takeSeen(u)) {
+			if(users.missedPeriods(u) >= allowedMisses) {
+				cout << "Logging out user " << users.name(u) << " due to inactivity" << endl;
 				logout(u);
+			} else {
+				users.missPeriod(u);
 			}
-			u->seen = false;
 		}
 	}
-	signal(SIGALRM, timerExpired);
+	load.sheddingThisPeriod = load.shedding;
+	load.dropsAtExpiry = load.kernelDrops;
+	if(load.shedding) {
+		sampleLoad();
+	}
+	logLoad();
+	if(multicastEnabled) {
+		unsigned long says = 0, avoided = 0;
+		for(size_t i = 0; i < shards.size(); ++i) {
+			says += shards[i]->multicastSays;
+			avoided += shards[i]->unicastsAvoided;
+		}
+		cout << "multicast: " << says << " says sent to groups, " << avoided << " unicast copies avoided" << endl;
+	}
+	if(capture != NULL) {
+		capture->flush();
+		cout << "capture: " << capture->records << " records, " << capture->dropped << " dropped" << endl;
+	}
+	logEgress();
+	if(uring != NULL) {
+		cout << "io_uring: " << uring->received << " received, " << uring->sent << " sent, "
+			<< uring->enterCalls << " io_uring_enter calls, " << uring->sendFallbacks << " sendto fallbacks" << endl;
+	}
 	alarm(KEEP_ALIVE_DELAY);
 }
 
+// Fills a token from the kernel's random pool.  random() is only a last
+// resort if /dev/urandom can't be read.
+void newSessionToken(SessionToken & token) {
+	if(randomFd == -1 || read(randomFd, token.bytes, SESSION_TOKEN_LEN) != SESSION_TOKEN_LEN) {
+		for(int i = 0; i < SESSION_TOKEN_LEN; ++i) {
+			token.bytes[i] = random() & 0xff;
+		}
+	}
+}
+
+void sendSessionToken(UserHandle user) {
+	struct text_session pkt;
+	pkt.txt_type = htonl(TXT_SESSION);
+	memcpy(pkt.txt_token, users.cold(user).token.bytes, SESSION_TOKEN_LEN);
+	sendToUser(user, &pkt, sizeof(text_session), "while sending session token");
+}
+
+// Handles the token in a keep-alive.  A known token from another address
+// moves that session here, and with it every channel membership, since
+// channels only hold the handle.  Whoever this address belonged to before
+// is logged out, since the address isn't theirs any more.  Returns the user
+// the packet belongs to.
+UserHandle resumeSession(const request_keep_alive_token * pkt, UserHandle sender, const struct sockaddr_storage * fromAddr, const char * key) {
+	SessionToken token;
+	memcpy(token.bytes, pkt->req_token, SESSION_TOKEN_LEN);
+	UserHandle user = users.findToken(token);
+	if(user == NO_USER || user == sender) {
+		return user == NO_USER ? sender : user;
+	}
+	if(sender != NO_USER) {
+		cout << "Address " << key << " now belongs to " << users.name(user) << ", logging out " << users.name(sender) << endl;
+		logout(sender);
+	}
+	cout << "User " << users.name(user) << " moved to " << key << endl;
+	users.moveTo(user, fromAddr);
+	users.markSeen(user);
+	return user;
+}
+
+// Decodes one datagram and acts on it.  Session-wide requests (login,
+// logout, keep-alive, list) are handled here; channel requests go through
+// routeChannelOp() so that, when pipelined, they run on the owning shard.
+void handleRequest(request * buf, int recvSize, struct sockaddr_storage * fromAddr) {
+	if(capture != NULL) {
+		capture->record(buf, recvSize, fromAddr);
+	}
+	char ipstr[INET6_ADDRSTRLEN];
+	int port;
+	if (fromAddr->ss_family == AF_INET) {
+	    struct sockaddr_in *s = (struct sockaddr_in *)fromAddr;
+	    port = ntohs(s->sin_port);
+	    inet_ntop(AF_INET, &s->sin_addr, ipstr, sizeof(ipstr));
+	} else {
+	    struct sockaddr_in6 *s = (struct sockaddr_in6 *)fromAddr;
+	    port = ntohs(s->sin6_port);
+	    inet_ntop(AF_INET6, &s->sin6_addr, ipstr, sizeof(ipstr));
+	}
+
+	char ip_port_str[INET6_ADDRSTRLEN + 30];
+	snprintf(ip_port_str, INET6_ADDRSTRLEN + 30, "%s/%d", ipstr, port);
+
+	if(recvSize >= sizeof(request)) {
+		// One session lookup per request.  Any datagram, even one shed
+		// below, shows the user is alive.
+		UserHandle sender = users.find(fromAddr);
+		if(sender != NO_USER) {
+			users.markSeen(sender);
+		}
+		buf->req_type = ntohl(buf->req_type);
+
+		if(++load.sinceSample >= LOAD_SAMPLE_REQUESTS) {
+			sampleLoad();
+		}
+		if(load.shedding && !admitUnderLoad(buf, recvSize, sender)) {
+			return;
+		}
+
+		switch(buf->req_type) {
+			case REQ_LOGIN:
+				if(recvSize >= sizeof(request_login)) {
+					request_login * pkt = (request_login *)buf;
+					NameRecord userName(pkt->req_username, USERNAME_MAX);
+					if(userName.empty()) {
+						sendErrorTo(fromAddr, "Username length must be non-zero");
+					} else {
+						if(sender != NO_USER) {
+							// A second login from the same address replaces the session.
+							logout(sender);
+						}
+						SessionToken token;
+						newSessionToken(token);
+						UserHandle user = users.create(userName, fromAddr, token);
+						if(user == NO_USER) {
+							sendErrorTo(fromAddr, "Server is full!");
+						} else {
+							cout << "User " << userName << " logged in from " << ip_port_str << endl;
+							sendSessionToken(user);
+						}
+					}
+				} else {
+					cerr << "Expected a login packet to have " << sizeof(request_login) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;	
+			
+			case REQ_LOGOUT:
+				if(recvSize >= sizeof(request_logout)) {
+					if(sender != NO_USER) {
+						cout << "User " << users.name(sender) << " logged out." << endl;
+					}
+					logout(sender);
+				} else {
+					cerr << "Expected a logout packet to have " << sizeof(request_logout) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;	
+		
+			case REQ_JOIN:
+				if(recvSize >= sizeof(request_join)) {
+					request_join * pkt = (request_join *)buf;
+					UserHandle user = sender;
+					NameRecord chanName(pkt->req_channel, CHANNEL_MAX);
+					routeChannelOp(REQ_JOIN, user, chanName, NULL);
+				} else {
+					cerr << "Expected a join packet to have " << sizeof(request_join) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;	
+			
+			case REQ_LEAVE:
+				if(recvSize >= sizeof(request_leave)) {
+					request_leave * pkt = (request_leave *)buf;
+					UserHandle user = sender;
+					NameRecord chanName(pkt->req_channel, CHANNEL_MAX);
+					routeChannelOp(REQ_LEAVE, user, chanName, NULL);
+				} else {
+					cerr << "Expected a leave packet to have " << sizeof(request_leave) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;	
+			
+			case REQ_SAY:
+				if(recvSize >= sizeof(request_say)) {
+					request_say * pkt = (request_say *)buf;
+					UserHandle user = sender;
+					NameRecord chanName(pkt->req_channel, CHANNEL_MAX);
+					routeChannelOp(REQ_SAY, user, chanName, pkt->req_text);
+				} else {
+					cerr << "Expected a say packet to have " << sizeof(request_leave) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;	
+		
+			case REQ_LIST:
+				if(recvSize >= sizeof(request_list)) {
+					UserHandle user = sender;
+					listChannels(user);
+				} else {
+					cerr << "Expected a list packet to have " << sizeof(request_logout) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;	
+		
+			case REQ_WHO:
+				if(recvSize >= sizeof(request_who)) {
+					request_who * pkt = (request_who *) buf;
+					UserHandle user = sender;
+					NameRecord chanName(pkt->req_channel, CHANNEL_MAX);
+					routeChannelOp(REQ_WHO, user, chanName, NULL);
+				} else {
+					cerr << "Expected a who packet to have " << sizeof(request_logout) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;
+			
+			case REQ_JOIN_MANY:
+				if(recvSize >= sizeof(request_join_many)) {
+					request_join_many * pkt = (request_join_many *) buf;
+					int n = ntohl(pkt->req_nchannels);
+					if(n < 0 || n > JOIN_MANY_MAX || recvSize < sizeof(request_join_many) + n * CHANNEL_MAX) {
+						cerr << "Bad multi-join packet: " << n << " channels in " << recvSize << " bytes" << endl;
+					} else {
+						routeJoinMany(sender, pkt->req_channels, n);
+					}
+				} else {
+					cerr << "Expected a multi-join packet to have at least " << sizeof(request_join_many) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;
+
+			case REQ_MULTICAST_ACK:
+				if(recvSize >= sizeof(request_multicast_ack)) {
+					request_multicast_ack * pkt = (request_multicast_ack *) buf;
+					NameRecord chanName(pkt->req_channel, CHANNEL_MAX);
+					char group[SAY_MAX];
+					memcpy(group, &pkt->req_group, sizeof(pkt->req_group));
+					routeChannelOp(REQ_MULTICAST_ACK, sender, chanName, group);
+				} else {
+					cerr << "Expected a multicast ack to have " << sizeof(request_multicast_ack) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;
+
+			case REQ_PRESENCE:
+				if(recvSize >= sizeof(request_presence)) {
+					request_presence * pkt = (request_presence *) buf;
+					UserHandle user = sender;
+					NameRecord chanName(pkt->req_channel, CHANNEL_MAX);
+					routeChannelOp(ntohl(pkt->req_subscribe) ? OP_SUBSCRIBE : OP_UNSUBSCRIBE, user, chanName, NULL);
+				} else {
+					cerr << "Expected a presence packet to have " << sizeof(request_presence) << " bytes, but got " << recvSize << " bytes." << endl;
+				}
+				break;
+			
+			case REQ_KEEP_ALIVE:
+				if(recvSize >= sizeof(request_keep_alive)) {
+					UserHandle user = sender;
+					if(recvSize >= sizeof(request_keep_alive_token)) {
+						user = resumeSession((request_keep_alive_token *) buf, sender, fromAddr, ip_port_str);
+					}
+					if(user != NO_USER) {
+						cout << "Got keep alive from " << users.name(user) << endl;
+					} else {
+						cerr << "Got keep-alive from nonexistent user" << endl;
+					}
+				}
+				break;
+		
+			default: cerr << "Unrecognized packet type " << buf->req_type << endl;
+		}
+	} else {
+		cerr << "Expected a packet to have at least " << sizeof(request) << " bytes, but got " << recvSize << " bytes." << endl;
+	}
+}
+
+// Writes out what is left of the capture on the way out.
+void finishCapture() {
+	if(capture == NULL) {
+		return;
+	}
+	capture->close();
+	cout << "capture: " << capture->records << " records, " << capture->dropped << " dropped, "
+		<< capture->writeErrors << " write errors" << endl;
+	delete capture;
+	capture = NULL;
+}
+
+// Resident memory of this process, in bytes.
+static long residentBytes() {
+	long pages = 0;
+	FILE * f = fopen("/proc/self/statm", "r");
+	if(f != NULL) {
+		if(fscanf(f, "%*ld %ld", &pages) != 1) {
+			pages = 0;
+		}
+		fclose(f);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Opens count sessions from made-up IPv4 addresses, all in Common, and
+// reports what each one costs.  Run with -b.
+int runSessionBenchmark(long count) {
+	maxSessions = count;
+	maxChannelUsers = count;
+	if(!users.init(maxSessions)) {
+		std::cerr << "error: unable to allocate the session store" << std::endl;
+		return 1;
+	}
+	startShards(0);
+	Channel * common = new Channel(commonName, myShard);
+	myShard->channels[commonName] = common;
+	long before = residentBytes();
+	double start = monotonicNow();
+	struct sockaddr_storage address;
+	memset(&address, 0, sizeof(address));
+	struct sockaddr_in * in = (struct sockaddr_in *) &address;
+	in->sin_family = AF_INET;
+	char name[USERNAME_MAX + 1];
+	for(long i = 0; i < count; ++i) {
+		in->sin_addr.s_addr = htonl(0x0a000000 + (i >> 4));
+		in->sin_port = htons(20000 + (i & 15));
+		snprintf(name, sizeof(name), "user%ld", i);
+		SessionToken token;
+		memcpy(token.bytes, &i, sizeof(i));
+		memcpy(token.bytes + sizeof(i), &start, sizeof(start));
+		UserHandle u = users.create(NameRecord(name), &address, token);
+		users.addMembership(u, common);
+		common->users.push_back(u);
+		common->acked.push_back(0);
+	}
+	double elapsed = monotonicNow() - start;
+	long after = residentBytes();
+	cerr << count << " sessions in " << elapsed << " s" << endl;
+	cerr << "resident: " << (after - before) / count << " bytes/session" << endl;
+	cerr << "layout: " << users.hotBytesPerSlot() << " hot + " << users.coldBytesPerSlot() << " cold + "
+		<< users.indexBytesPerSlot() << " index bytes per slot, " << SessionStore::bytesPerMembership()
+		<< " per membership, " << sizeof(UserHandle) + sizeof(uint8_t) << " per channel member" << endl;
+	return 0;
+}
+
+void handleDatagram(char * data, int len, struct sockaddr_storage * from) {
+	handleRequest((request *) data, len, from);
+}
+
+// Parses -m and readies the socket to send to groups: out of the interface
+// the server is bound to (so loopback works for testing), looped back to
+// local members, and not routed beyond the LAN.
+void setupMulticast(const char * spec, const struct sockaddr * bound, int serverPort) {
+	string base(spec);
+	int port = serverPort + 1;
+	size_t colon = base.find(':');
+	if(colon != string::npos) {
+		port = atoi(base.c_str() + colon + 1);
+		base.erase(colon);
+	}
+	struct in_addr group;
+	if(inet_pton(AF_INET, base.c_str(), &group) != 1 || !IN_MULTICAST(ntohl(group.s_addr)) || port <= 0 || port > 65535) {
+		cerr << "error: -m needs an IPv4 multicast address and optionally a port, like 239.192.0.0:4001" << endl;
+		exit(-1);
+	}
+	if(multicastThreshold < 1) {
+		cerr << "error: multicast threshold must be at least 1" << endl;
+		exit(-1);
+	}
+	multicastBase = ntohl(group.s_addr);
+	multicastPort = htons(port);
+	unsigned char loop = 1;
+	unsigned char ttl = 1;
+	if(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1) {
+		perror("setting IP_MULTICAST_LOOP");
+	}
+	if(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1) {
+		perror("setting IP_MULTICAST_TTL");
+	}
+	const struct sockaddr_in * in = (const struct sockaddr_in *) bound;
+	if(bound->sa_family == AF_INET && in->sin_addr.s_addr != htonl(INADDR_ANY) &&
+			setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &in->sin_addr, sizeof(in->sin_addr)) == -1) {
+		perror("setting IP_MULTICAST_IF");
+	}
+	multicastEnabled = true;
+	cout << "Multicast fan-out for channels of " << multicastThreshold << " or more members, groups from "
+		<< base << " port " << port << endl;
+}
+
 int main(int argc, char ** argv) {
 	
-	signal(SIGALRM, timerExpired);
+	// No SA_RESTART: the alarm has to interrupt recvfrom so the main loop
+	// can expire idle users.
+	struct sigaction alarmAction;
+	memset(&alarmAction, 0, sizeof(alarmAction));
+	alarmAction.sa_handler = timerExpired;
+	sigaction(SIGALRM, &alarmAction, NULL);
 	alarm(KEEP_ALIVE_DELAY);
 	
-	if(argc != 3) {
-        std::cerr << "usage: " << argv[0] << " server_name port" << std::endl;
+	int numShards = 0;
+	bool useUring = false;
+	int rcvBuf = 0;
+	int sndBuf = 0;
+	const char * captureName = NULL;
+	long benchSessions = 0;
+	int opt;
+	const char * multicastSpec = NULL;
+	while((opt = getopt(argc, argv, "p:uR:S:c:N:U:C:b:m:T:")) != -1) {
+		switch(opt) {
+			case 'm':
+				multicastSpec = optarg;
+				break;
+			case 'T':
+				multicastThreshold = atol(optarg);
+				break;
+			case 'N':
+				maxSessions = atol(optarg);
+				break;
+			case 'U':
+				maxChannelUsers = atoi(optarg);
+				break;
+			case 'C':
+				maxChannels = atoi(optarg);
+				break;
+			case 'b':
+				benchSessions = atol(optarg);
+				break;
+			case 'c':
+				captureName = optarg;
+				break;
+			case 'R':
+				rcvBuf = atoi(optarg);
+				break;
+			case 'S':
+				sndBuf = atoi(optarg);
+				break;
+			case 'u':
+				useUring = true;
+				break;
+			case 'p':
+				numShards = atoi(optarg);
+				if(numShards < 1 || numShards > MAX_SHARDS) {
+					std::cerr << "error: shard count must be between 1 and " << MAX_SHARDS << std::endl;
+					exit(-1);
+				}
+				break;
+			default:
+				std::cerr << "usage: " << argv[0] << " [-p shards] [-u] [-R rcvbuf_bytes] [-S sndbuf_bytes] [-c capture_file] [-N max_sessions] [-U max_channel_users] [-C max_channels] [-m group_base[:port]] [-T multicast_threshold] server_name port" << std::endl;
+				exit(-1);
+		}
+	}
+	if(benchSessions > 0) {
+		return runSessionBenchmark(benchSessions);
+	}
+	if(maxSessions < 1 || maxSessions > SessionStore::MAX_CAPACITY || maxChannelUsers < 1 || maxChannels < 1) {
+		std::cerr << "error: limits must be positive, with at most " << SessionStore::MAX_CAPACITY << " sessions" << std::endl;
+		exit(-1);
+	}
+	if(argc - optind != 2) {
+        std::cerr << "usage: " << argv[0] << " [-p shards] [-u] [-R rcvbuf_bytes] [-S sndbuf_bytes] [-c capture_file] [-N max_sessions] [-U max_channel_users] [-C max_channels] [-m group_base[:port]] [-T multicast_threshold] server_name port" << std::endl;
         exit(-1);
     }
-    char * hostName = argv[1];
-    int portNum = atoi(argv[2]);
-    char * portNumStr = argv[2];
+    char * hostName = argv[optind];
+    int portNum = atoi(argv[optind+1]);
+    char * portNumStr = argv[optind+1];
 
     if(portNum < 0 || portNum > 65535) {
         std::cerr << "error: port number must be between 0 and 65535" << std::endl;
@@ -400,6 +1715,30 @@ int main(int argc, char ** argv) {
     }
 
    // fcntl(sock, F_SETFL, O_NONBLOCK);
+
+	// A bigger receive buffer rides out longer bursts before the kernel has
+	// to drop anything; SO_RXQ_OVFL tells us when it does anyway.
+	if(rcvBuf > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf)) == -1) {
+		perror("setting SO_RCVBUF");
+	}
+	if(sndBuf > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf)) == -1) {
+		perror("setting SO_SNDBUF");
+	}
+#ifdef SO_RXQ_OVFL
+	int one = 1;
+	if(setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) == -1) {
+		perror("enabling SO_RXQ_OVFL");
+	}
+#endif
+	socklen_t optLen = sizeof(rcvBuf);
+	getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvBuf, &optLen);
+	optLen = sizeof(sndBuf);
+	getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndBuf, &optLen);
+	cout << "Socket buffers: " << rcvBuf << " bytes receive, " << sndBuf << " bytes send" << endl;
+
+	if(multicastSpec != NULL) {
+		setupMulticast(multicastSpec, p->ai_addr, portNum);
+	}
     
 	char ipstr[INET6_ADDRSTRLEN];
 	int port;
@@ -414,147 +1753,95 @@ int main(int argc, char ** argv) {
 	    inet_ntop(AF_INET6, &s->sin6_addr, ipstr, sizeof(ipstr));
 	}
 	
-	Channel * common = new Channel("Common");
-	channels["Common"] = common;
+	randomFd = open("/dev/urandom", O_RDONLY);
+	if(randomFd == -1) {
+		perror("opening /dev/urandom, session tokens will be guessable");
+		srandom(time(NULL) ^ getpid());
+	}
+
+	if(captureName != NULL) {
+		capture = new CaptureWriter();
+		if(!capture->open(captureName)) {
+			exit(-6);
+		}
+		// A capture is only complete once its buffers are written out, so
+		// interrupting the server has to go through the main loop.
+		struct sigaction stopAction;
+		memset(&stopAction, 0, sizeof(stopAction));
+		stopAction.sa_handler = stopSignalled;
+		sigaction(SIGINT, &stopAction, NULL);
+		sigaction(SIGTERM, &stopAction, NULL);
+		cout << "Capturing inbound traffic to " << captureName << endl;
+	}
+
+	if(!users.init(maxSessions)) {
+		std::cerr << "error: unable to allocate the session store" << std::endl;
+		exit(-6);
+	}
+	cout << "Limits: " << maxSessions << " sessions, " << maxChannels << " channels, "
+		<< maxChannelUsers << " users per channel" << endl;
+
+	egress = new Egress(sock);
+	startShards(numShards);
+	Channel * common = new Channel(commonName, shardFor(commonName));
+	shardFor(commonName)->channels[commonName] = common;
+	numChannels = 1;
 		
 	cout << "Waiting for packets on " << ipstr << " local port " << port << endl;
 		
-	request * buf = (request *) malloc( sizeof(request_say) );
-	 
-	while(true) {
-		struct sockaddr_storage * fromAddr = new struct sockaddr_storage;
-		socklen_t fromAddrLen = sizeof(sockaddr_storage);
-		int recvSize = recvfrom(sock, buf, sizeof(request_say), 0, (struct sockaddr *)fromAddr, &fromAddrLen);
-		if(recvSize != -1) {
-			if (fromAddr->ss_family == AF_INET) {
-			    struct sockaddr_in *s = (struct sockaddr_in *)fromAddr;
-			    port = ntohs(s->sin_port);
-			    inet_ntop(AF_INET, &s->sin_addr, ipstr, sizeof(ipstr));
-			} else {
-			    struct sockaddr_in6 *s = (struct sockaddr_in6 *)fromAddr;
-			    port = ntohs(s->sin6_port);
-			    inet_ntop(AF_INET6, &s->sin6_addr, ipstr, sizeof(ipstr));
-			}
-		
-			char ip_port_str[INET6_ADDRSTRLEN + 30];
-			snprintf(ip_port_str, INET6_ADDRSTRLEN + 30, "%s/%d", ipstr, port);
-		
-			if(recvSize >= sizeof(request)) {
-				if(users[ip_port_str] != NULL) {
-					users[ip_port_str]->seen = true;
+	if(useUring) {
+		uring = new UringSocket();
+		if(uring->init(sock)) {
+			cout << "Using io_uring backend" << endl;
+			while(!stopRequested) {
+				if(timerFired) {
+					expireIdleUsers();
 				}
-				buf->req_type = ntohl(buf->req_type);
-
-				switch(buf->req_type) {
-					case REQ_LOGIN:
-						if(recvSize >= sizeof(request_login)) {
-							request_login * pkt = (request_login *)buf;
-							char userName[USERNAME_MAX+1];
-							memset(userName, '\0', USERNAME_MAX+1);
-							strncpy(userName, pkt->req_username, USERNAME_MAX);
-							User * user = new User(userName, ip_port_str, fromAddr);
-							if(strnlen(userName, USERNAME_MAX) == 0) {
-								sendError(user, "Username length must be non-zero");
-								delete user;
-							} else {
-								users[ip_port_str] = user;
-								cout << "User " << user->name << " logged in from " << ip_port_str << endl;
-								//addUserToChannel(user, common);
-							}
-						} else {
-							cerr << "Expected a login packet to have " << sizeof(request_login) << " bytes, but got " << recvSize << " bytes." << endl;
-						}
-						break;	
-					
-					case REQ_LOGOUT:
-						if(recvSize >= sizeof(request_logout)) {
-							cout << "User " << users[ip_port_str]->name << " logged out." << endl;
-							logout(users[ip_port_str]);
-						} else {
-							cerr << "Expected a logout packet to have " << sizeof(request_logout) << " bytes, but got " << recvSize << " bytes." << endl;
-						}
-						break;	
-				
-					case REQ_JOIN:
-						if(recvSize >= sizeof(request_join)) {
-							request_join * pkt = (request_join *)buf;
-							User * user = users[ip_port_str];
-							char chanName[CHANNEL_MAX+1];
-							memset(chanName, '\0', CHANNEL_MAX+1);
-							strncpy(chanName, pkt->req_channel, CHANNEL_MAX);
-							addUserToChannelNamed(user, chanName);
-						} else {
-							cerr << "Expected a join packet to have " << sizeof(request_join) << " bytes, but got " << recvSize << " bytes." << endl;
-						}
-						break;	
-					
-					case REQ_LEAVE:
-						if(recvSize >= sizeof(request_leave)) {
-							request_leave * pkt = (request_leave *)buf;
-							User * user = users[ip_port_str];
-							char chanName[CHANNEL_MAX+1];
-							memset(chanName, '\0', CHANNEL_MAX+1);
-							strncpy(chanName, pkt->req_channel, CHANNEL_MAX);
-							removeUserFromChannelNamed(user, chanName);
-						} else {
-							cerr << "Expected a leave packet to have " << sizeof(request_leave) << " bytes, but got " << recvSize << " bytes." << endl;
-						}
-						break;	
-					
-					case REQ_SAY:
-						if(recvSize >= sizeof(request_say)) {
-							request_say * pkt = (request_say *)buf;
-							User * user = users[ip_port_str];
-							char chanName[CHANNEL_MAX+1];
-							memset(chanName, '\0', CHANNEL_MAX+1);
-							strncpy(chanName, pkt->req_channel, CHANNEL_MAX);
-							Channel * channel = channels[chanName];
-							say(user, channel, pkt->req_text);
-						} else {
-							cerr << "Expected a say packet to have " << sizeof(request_leave) << " bytes, but got " << recvSize << " bytes." << endl;
-						}
-						break;	
-				
-					case REQ_LIST:
-						if(recvSize >= sizeof(request_list)) {
-							User * user = users[ip_port_str];
-							listChannels(user);
-						} else {
-							cerr << "Expected a list packet to have " << sizeof(request_logout) << " bytes, but got " << recvSize << " bytes." << endl;
-						}
-						break;	
-				
-					case REQ_WHO:
-						if(recvSize >= sizeof(request_who)) {
-							request_who * pkt = (request_who *) buf;
-							User * user = users[ip_port_str];
-							char chanName[CHANNEL_MAX+1];
-							memset(chanName, '\0', CHANNEL_MAX+1);
-							strncpy(chanName, pkt->req_channel, CHANNEL_MAX);
-							Channel * channel = channels[chanName];
-							who(user, channel);
-						} else {
-							cerr << "Expected a who packet to have " << sizeof(request_logout) << " bytes, but got " << recvSize << " bytes." << endl;
-						}
-						break;
-					
-					case REQ_KEEP_ALIVE:
-						if(recvSize >= sizeof(request_keep_alive)) {
-							User * user = users[ip_port_str];
-							if(user != NULL) {
-								cout << "Got keep alive from " << user->name << endl;
-							} else {
-								cerr << "Got keep-alive from nonexistent user" << endl;
-							}
-						}
-						break;
-				
-					default: cerr << "Unrecognized packet type " << buf->req_type << endl;
+				uring->run(handleDatagram);
+				if(load.shedding) {
+					sampleLoad();
 				}
-			} else {
-				cerr << "Expected a packet to have at least " << sizeof(request) << " bytes, but got " << recvSize << " bytes." << endl;
+				flushPresence();
 			}
+			finishCapture();
+			return 0;
 		}
+		cerr << "io_uring unavailable, falling back to recvfrom/sendto" << endl;
+		delete uring;
+		uring = NULL;
 	}
-    
+
+	request * buf = (request *) malloc( MAX_REQUEST_SIZE );
+	 
+	while(!stopRequested) {
+		if(timerFired) {
+			expireIdleUsers();
+		}
+		egress->drain();
+		struct sockaddr_storage fromAddr;
+		int recvSize = -1;
+		if(presencePending() || load.shedding || egress->pending()) {
+			// Presence deltas wait until the socket runs dry, so a burst of
+			// joins and parts goes out as one batch.  Shedding is re-checked
+			// once its hold time is up, so deferred requests aren't stuck
+			// waiting for the next datagram, and a send backlog as soon as
+			// the socket has room for it.
+			recvSize = receiveDatagram(buf, MAX_REQUEST_SIZE, MSG_DONTWAIT, &fromAddr);
+			if(recvSize == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				socketIdle();
+				if(load.shedding || egress->pending()) {
+					waitForSocket();
+					continue;
+				}
+			}
+		}
+		if(recvSize == -1) {
+			recvSize = receiveDatagram(buf, MAX_REQUEST_SIZE, 0, &fromAddr);
+		}
+		if(recvSize != -1) {
+			handleRequest(buf, recvSize, &fromAddr);
+		}
+	}
+	finishCapture();
+	return 0;
 }
@@ -0,0 +1,434 @@
+/*
+ *	sessionstore.cpp
+ *	Column-wise session storage; see sessionstore.h.
+ */
+
+#include "sessionstore.h"
+
+#include <stdlib.h>
+#include <netinet/in.h>
+
+// An IPv4 address and port fit in the endpoint word itself (address in bits
+// 16-47, port in 0-15, both in network order, and IPV4_TAG so the word is
+// never zero).  Anything else is a heap copy of the sockaddr with
+// POINTER_TAG set.
+static const uint64_t IPV4_TAG = 1ULL << 48;
+static const uint64_t POINTER_TAG = 1ULL << 63;
+
+static size_t mix(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (size_t) h;
+}
+
+static size_t familyLength(int family) {
+	switch(family) {
+		case AF_INET: return sizeof(struct sockaddr_in);
+		case AF_INET6: return sizeof(struct sockaddr_in6);
+		default: return sizeof(struct sockaddr_storage);
+	}
+}
+
+SessionStore::SessionStore() : cap(0), highWater(0), live(0), endpoints(NULL), flags(NULL), missed(NULL),
+		memberships(NULL), generations(NULL), names(NULL), colds(NULL), freeSlots(NULL), freeHead(0),
+		freeCount(0), freeLock(0), byAddress(NULL), byToken(NULL), indexMask(0), poolChunksUsed(0),
+		poolFree(0), poolLock(0) {
+	memset(listLocks, 0, sizeof(listLocks));
+}
+
+SessionStore::~SessionStore() {
+	for(size_t slot = 0; slot < highWater; ++slot) {
+		if(endpoints[slot] & POINTER_TAG) {
+			free((void *) (uintptr_t) (endpoints[slot] & ~POINTER_TAG));
+		}
+		if(colds[slot].retired != NULL) {
+			for(size_t i = 0; i < colds[slot].retired->size(); ++i) {
+				free((*colds[slot].retired)[i]);
+			}
+			delete colds[slot].retired;
+		}
+	}
+	free(endpoints);
+	free(flags);
+	free(missed);
+	free(memberships);
+	free(generations);
+	free(names);
+	free(colds);
+	free(freeSlots);
+	free(byAddress);
+	free(byToken);
+	for(size_t i = 0; i < poolChunksUsed; ++i) {
+		free(poolChunks[i]);
+	}
+}
+
+bool SessionStore::init(size_t capacity) {
+	if(capacity < 1 || capacity > MAX_CAPACITY) {
+		return false;
+	}
+	cap = capacity;
+	size_t indexSize = 1;
+	while(indexSize < 2 * capacity) {
+		indexSize <<= 1;
+	}
+	indexMask = indexSize - 1;
+	endpoints = (uint64_t *) calloc(cap, sizeof(uint64_t));
+	flags = (uint8_t *) calloc(cap, sizeof(uint8_t));
+	missed = (uint8_t *) calloc(cap, sizeof(uint8_t));
+	memberships = (uint32_t *) calloc(cap, sizeof(uint32_t));
+	generations = (uint8_t *) calloc(cap, sizeof(uint8_t));
+	names = (NameRecord *) calloc(cap, sizeof(NameRecord));
+	colds = (SessionCold *) calloc(cap, sizeof(SessionCold));
+	freeSlots = (uint32_t *) calloc(cap, sizeof(uint32_t));
+	byAddress = (UserHandle *) calloc(indexSize, sizeof(UserHandle));
+	byToken = (UserHandle *) calloc(indexSize, sizeof(UserHandle));
+	return endpoints != NULL && flags != NULL && missed != NULL && memberships != NULL &&
+		generations != NULL && names != NULL && colds != NULL && freeSlots != NULL &&
+		byAddress != NULL && byToken != NULL;
+}
+
+void SessionStore::lock(int * l) {
+	while(__sync_lock_test_and_set(l, 1)) {
+	}
+}
+
+void SessionStore::unlock(int * l) {
+	__sync_lock_release(l);
+}
+
+uint64_t SessionStore::endpointFor(const struct sockaddr_storage * address) const {
+	if(address->ss_family == AF_INET) {
+		const struct sockaddr_in * in = (const struct sockaddr_in *) address;
+		return IPV4_TAG | ((uint64_t) in->sin_addr.s_addr << 16) | in->sin_port;
+	}
+	return 0;
+}
+
+size_t SessionStore::addressHash(const struct sockaddr_storage * address, uint64_t endpoint) const {
+	if(endpoint != 0) {
+		return mix(endpoint);
+	}
+	// FNV-1a over the whole sockaddr; only for families that don't pack.
+	const unsigned char * bytes = (const unsigned char *) address;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < familyLength(address->ss_family); ++i) {
+		h = (h ^ bytes[i]) * 0x100000001b3ULL;
+	}
+	return mix(h);
+}
+
+bool SessionStore::sameAddress(size_t slot, const struct sockaddr_storage * address, uint64_t endpoint) const {
+	uint64_t stored = endpoints[slot];
+	if(endpoint != 0 || !(stored & POINTER_TAG)) {
+		return stored == endpoint;
+	}
+	const struct sockaddr_storage * other = (const struct sockaddr_storage *) (uintptr_t) (stored & ~POINTER_TAG);
+	return other->ss_family == address->ss_family &&
+		memcmp(other, address, familyLength(address->ss_family)) == 0;
+}
+
+size_t SessionStore::hashOfSlot(size_t slot, bool byAddr) const {
+	if(!byAddr) {
+		uint64_t h;
+		memcpy(&h, colds[slot].token.bytes, sizeof(h));
+		return mix(h);
+	}
+	uint64_t stored = endpoints[slot];
+	if(stored & POINTER_TAG) {
+		return addressHash((const struct sockaddr_storage *) (uintptr_t) (stored & ~POINTER_TAG), 0);
+	}
+	return mix(stored);
+}
+
+void SessionStore::indexInsert(UserHandle * table, size_t hash, UserHandle u) {
+	size_t i = hash & indexMask;
+	while(table[i] != NO_USER) {
+		i = (i + 1) & indexMask;
+	}
+	table[i] = u;
+}
+
+// Linear probing with backward-shift deletion, so there are no tombstones
+// to slow lookups down as users come and go.
+void SessionStore::indexRemove(UserHandle * table, UserHandle u, bool byAddr) {
+	size_t i = hashOfSlot(slotOf(u), byAddr) & indexMask;
+	while(table[i] != u) {
+		if(table[i] == NO_USER) {
+			return;
+		}
+		i = (i + 1) & indexMask;
+	}
+	size_t j = i;
+	while(true) {
+		table[i] = NO_USER;
+		while(true) {
+			j = (j + 1) & indexMask;
+			if(table[j] == NO_USER) {
+				return;
+			}
+			size_t home = hashOfSlot(slotOf(table[j]), byAddr) & indexMask;
+			// Move table[j] back unless its home lies cyclically in (i, j].
+			bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+			if(!stays) {
+				break;
+			}
+		}
+		table[i] = table[j];
+		i = j;
+	}
+}
+
+UserHandle SessionStore::create(const NameRecord & name, const struct sockaddr_storage * address, const SessionToken & token) {
+	lock(&freeLock);
+	size_t slot;
+	if(freeCount > 0) {
+		slot = freeSlots[freeHead];
+		freeHead = (freeHead + 1) % cap;
+		--freeCount;
+	} else if(highWater < cap) {
+		slot = highWater++;
+		generations[slot] = 1;
+	} else {
+		unlock(&freeLock);
+		return NO_USER;
+	}
+	unlock(&freeLock);
+
+	uint64_t endpoint = endpointFor(address);
+	if(endpoint == 0) {
+		struct sockaddr_storage * copy = (struct sockaddr_storage *) malloc(sizeof(struct sockaddr_storage));
+		memcpy(copy, address, sizeof(struct sockaddr_storage));
+		endpoint = POINTER_TAG | (uintptr_t) copy;
+	}
+	__atomic_store_n(&endpoints[slot], endpoint, __ATOMIC_RELEASE);
+	flags[slot] = LINKED | SEEN;
+	missed[slot] = 0;
+	memberships[slot] = 0;
+	names[slot] = name;
+	SessionCold & c = colds[slot];
+	c.token = token;
+	c.sayStamp = 0;
+	c.sayTokens = 0;
+	c.pendingPurges = 0;
+	c.retired = NULL;
+
+	UserHandle u = makeHandle(slot, generations[slot]);
+	indexInsert(byAddress, hashOfSlot(slot, true), u);
+	indexInsert(byToken, hashOfSlot(slot, false), u);
+	++live;
+	return u;
+}
+
+UserHandle SessionStore::find(const struct sockaddr_storage * address) const {
+	uint64_t endpoint = endpointFor(address);
+	size_t i = addressHash(address, endpoint) & indexMask;
+	while(byAddress[i] != NO_USER) {
+		if(sameAddress(slotOf(byAddress[i]), address, endpoint)) {
+			return byAddress[i];
+		}
+		i = (i + 1) & indexMask;
+	}
+	return NO_USER;
+}
+
+UserHandle SessionStore::findToken(const SessionToken & token) const {
+	uint64_t h;
+	memcpy(&h, token.bytes, sizeof(h));
+	size_t i = mix(h) & indexMask;
+	while(byToken[i] != NO_USER) {
+		if(colds[slotOf(byToken[i])].token == token) {
+			return byToken[i];
+		}
+		i = (i + 1) & indexMask;
+	}
+	return NO_USER;
+}
+
+void SessionStore::unlink(UserHandle u) {
+	size_t slot = slotOf(u);
+	if(!(flags[slot] & LINKED)) {
+		return;
+	}
+	indexRemove(byAddress, u, true);
+	indexRemove(byToken, u, false);
+	flags[slot] = 0;
+	--live;
+}
+
+void SessionStore::release(UserHandle u) {
+	size_t slot = slotOf(u);
+	uint64_t endpoint = endpoints[slot];
+	if(endpoint & POINTER_TAG) {
+		free((void *) (uintptr_t) (endpoint & ~POINTER_TAG));
+	}
+	endpoints[slot] = 0;
+	SessionCold & c = colds[slot];
+	if(c.retired != NULL) {
+		for(size_t i = 0; i < c.retired->size(); ++i) {
+			free((*c.retired)[i]);
+		}
+		delete c.retired;
+		c.retired = NULL;
+	}
+	uint8_t next = generations[slot] + 1;
+	__atomic_store_n(&generations[slot], next == 0 ? 1 : next, __ATOMIC_RELEASE);
+
+	lock(&freeLock);
+	freeSlots[(freeHead + freeCount) % cap] = slot;
+	++freeCount;
+	unlock(&freeLock);
+}
+
+// A packed endpoint is swapped in one store.  A heap address is only retired,
+// not freed, since a shard may be copying it right now.
+void SessionStore::moveTo(UserHandle u, const struct sockaddr_storage * address) {
+	size_t slot = slotOf(u);
+	indexRemove(byAddress, u, true);
+	uint64_t old = endpoints[slot];
+	uint64_t endpoint = endpointFor(address);
+	if(endpoint == 0) {
+		struct sockaddr_storage * copy = (struct sockaddr_storage *) malloc(sizeof(struct sockaddr_storage));
+		memcpy(copy, address, sizeof(struct sockaddr_storage));
+		endpoint = POINTER_TAG | (uintptr_t) copy;
+	}
+	__atomic_store_n(&endpoints[slot], endpoint, __ATOMIC_RELEASE);
+	if(old & POINTER_TAG) {
+		SessionCold & c = colds[slot];
+		if(c.retired == NULL) {
+			c.retired = new std::vector<struct sockaddr_storage *>();
+		}
+		c.retired->push_back((struct sockaddr_storage *) (uintptr_t) (old & ~POINTER_TAG));
+	}
+	indexInsert(byAddress, hashOfSlot(slot, true), u);
+}
+
+socklen_t SessionStore::address(UserHandle u, struct sockaddr_storage * out) const {
+	uint64_t endpoint = __atomic_load_n(&endpoints[slotOf(u)], __ATOMIC_ACQUIRE);
+	if(endpoint & POINTER_TAG) {
+		const struct sockaddr_storage * stored = (const struct sockaddr_storage *) (uintptr_t) (endpoint & ~POINTER_TAG);
+		size_t len = familyLength(stored->ss_family);
+		memcpy(out, stored, len);
+		return len;
+	}
+	struct sockaddr_in * in = (struct sockaddr_in *) out;
+	memset(in, 0, sizeof(struct sockaddr_in));
+	in->sin_family = AF_INET;
+	in->sin_addr.s_addr = (uint32_t) (endpoint >> 16);
+	in->sin_port = (uint16_t) endpoint;
+	return sizeof(struct sockaddr_in);
+}
+
+uint32_t SessionStore::newEntry(Channel * channel) {
+	lock(&poolLock);
+	if(poolFree == 0) {
+		if(poolChunksUsed == POOL_MAX_CHUNKS) {
+			unlock(&poolLock);
+			return 0;
+		}
+		Membership * chunk = (Membership *) malloc(POOL_CHUNK * sizeof(Membership));
+		size_t base = poolChunksUsed << POOL_CHUNK_BITS;
+		poolChunks[poolChunksUsed++] = chunk;
+		// Entry 0 stands for "none", so it never goes on the free list.
+		for(size_t i = POOL_CHUNK; i-- > (base == 0 ? 1 : 0); ) {
+			chunk[i].next = poolFree;
+			poolFree = base + i;
+		}
+	}
+	uint32_t index = poolFree;
+	poolFree = entry(index).next;
+	unlock(&poolLock);
+	entry(index).channel = channel;
+	return index;
+}
+
+void SessionStore::freeEntry(uint32_t index) {
+	lock(&poolLock);
+	entry(index).next = poolFree;
+	poolFree = index;
+	unlock(&poolLock);
+}
+
+bool SessionStore::isMember(UserHandle u, const Channel * channel) {
+	size_t slot = slotOf(u);
+	int * l = &listLocks[slot % LIST_LOCKS];
+	lock(l);
+	bool found = false;
+	for(uint32_t i = memberships[slot]; i != 0 && !found; i = entry(i).next) {
+		found = entry(i).channel == channel;
+	}
+	unlock(l);
+	return found;
+}
+
+void SessionStore::addMembership(UserHandle u, Channel * channel) {
+	uint32_t index = newEntry(channel);
+	if(index == 0) {
+		return;
+	}
+	size_t slot = slotOf(u);
+	int * l = &listLocks[slot % LIST_LOCKS];
+	lock(l);
+	entry(index).next = memberships[slot];
+	memberships[slot] = index;
+	unlock(l);
+}
+
+bool SessionStore::removeMembership(UserHandle u, const Channel * channel) {
+	size_t slot = slotOf(u);
+	int * l = &listLocks[slot % LIST_LOCKS];
+	lock(l);
+	uint32_t * link = &memberships[slot];
+	while(*link != 0 && entry(*link).channel != channel) {
+		link = &entry(*link).next;
+	}
+	uint32_t index = *link;
+	if(index != 0) {
+		*link = entry(index).next;
+	}
+	unlock(l);
+	if(index == 0) {
+		return false;
+	}
+	freeEntry(index);
+	return true;
+}
+
+void SessionStore::takeMemberships(UserHandle u, bool (*owned)(const Channel *), std::vector<Channel *> & out) {
+	size_t slot = slotOf(u);
+	int * l = &listLocks[slot % LIST_LOCKS];
+	std::vector<uint32_t> freed;
+	lock(l);
+	uint32_t * link = &memberships[slot];
+	while(*link != 0) {
+		uint32_t index = *link;
+		if(owned(entry(index).channel)) {
+			out.push_back(entry(index).channel);
+			*link = entry(index).next;
+			freed.push_back(index);
+		} else {
+			link = &entry(index).next;
+		}
+	}
+	unlock(l);
+	for(size_t i = 0; i < freed.size(); ++i) {
+		freeEntry(freed[i]);
+	}
+}
+
+size_t SessionStore::hotBytesPerSlot() const {
+	return sizeof(*endpoints) + sizeof(*flags) + sizeof(*missed) + sizeof(*memberships) + sizeof(*generations);
+}
+
+size_t SessionStore::coldBytesPerSlot() const {
+	return sizeof(*names) + sizeof(*colds) + sizeof(*freeSlots);
+}
+
+size_t SessionStore::indexBytesPerSlot() const {
+	return cap == 0 ? 0 : 2 * (indexMask + 1) * sizeof(UserHandle) / cap;
+}
+
+size_t SessionStore::bytesPerMembership() {
+	return sizeof(Membership);
+}
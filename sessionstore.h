@@ -0,0 +1,235 @@
+#ifndef SESSIONSTORE_H
+#define SESSIONSTORE_H
+
+/*
+ *	sessionstore.h
+ *	Logged-in users, stored column-wise and named by 32-bit handles.
+ *
+ *	What the server touches for nearly every datagram (the address, whether
+ *	the user has been heard from, the head of its channel memberships) lives
+ *	in dense per-field arrays indexed by slot.  A say's fan-out or an expiry
+ *	sweep then walks a few bytes per user instead of chasing a heap object
+ *	each.  Names, resumption tokens and the shedding allowance sit in arrays
+ *	of their own, since they are needed far less often.
+ *
+ *	A handle is a slot index plus the slot's generation, which moves on each
+ *	time the slot is freed.  A handle held past its user's logout (by a
+ *	deferred WHO, say) is then recognisably stale rather than naming whoever
+ *	got the slot next.  Handle 0 is never issued.
+ *
+ *	Every array is allocated for the full capacity up front, but with
+ *	calloc, so slots never used cost address space and not memory, and
+ *	nothing ever moves: shard threads read the arrays while the ingress
+ *	thread logs users in and out.
+ *
+ *	Threads: create, unlink, moveTo, the lookups and the liveness fields are
+ *	for the ingress thread.  Addresses and names may be read, and
+ *	memberships changed, from any thread; release may be called from any
+ *	thread once no one else will use the handle.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "duckchat.h"
+#include "namerecord.h"
+
+typedef uint32_t UserHandle;
+const UserHandle NO_USER = 0;
+
+class Channel;
+
+// Opaque id of a session, handed to the client at login so it can take the
+// session with it when its address changes.
+struct SessionToken {
+	unsigned char bytes[SESSION_TOKEN_LEN];
+
+	bool operator==(const SessionToken & other) const {
+		return memcmp(bytes, other.bytes, SESSION_TOKEN_LEN) == 0;
+	}
+};
+
+// Per-user state the datagram path doesn't need.
+struct SessionCold {
+	SessionToken token;
+	double sayStamp;
+	float sayTokens;		// Say allowance while shedding
+	int pendingPurges;		// Shards that still have to drop this user after logout
+	std::vector<struct sockaddr_storage *> * retired;	// Old non-IPv4 addresses
+};
+
+class SessionStore {
+public:
+	static const int INDEX_BITS = 24;
+	static const size_t MAX_CAPACITY = (1 << INDEX_BITS) - 1;
+
+	SessionStore();
+	~SessionStore();
+
+	// Allocates room for capacity sessions.  Returns false if that is more
+	// than a handle can address or the memory isn't there.
+	bool init(size_t capacity);
+
+	// Opens a session.  Returns NO_USER if the store is full.
+	UserHandle create(const NameRecord & name, const struct sockaddr_storage * address, const SessionToken & token);
+
+	UserHandle find(const struct sockaddr_storage * address) const;
+	UserHandle findToken(const SessionToken & token) const;
+
+	// Takes the session out of both lookups, so no new request can reach it.
+	// The handle stays good, for shards still working through its requests,
+	// until release().
+	void unlink(UserHandle u);
+
+	// Frees the slot; the handle and any copies of it go stale.
+	void release(UserHandle u);
+
+	// Moves the session to a new address.  Shards may be reading the old one
+	// at the same time.
+	void moveTo(UserHandle u, const struct sockaddr_storage * address);
+
+	bool valid(UserHandle u) const {
+		return u != NO_USER && __atomic_load_n(&generations[slotOf(u)], __ATOMIC_ACQUIRE) == generationOf(u);
+	}
+
+	// Linked sessions by slot, for sweeping.  NO_USER for a free or
+	// unlinked slot.
+	size_t slotLimit() const {
+		return highWater;
+	}
+	UserHandle linkedAt(size_t slot) const {
+		return (flags[slot] & LINKED) ? makeHandle(slot, generations[slot]) : NO_USER;
+	}
+
+	// Fills in the user's address; returns its length.
+	socklen_t address(UserHandle u, struct sockaddr_storage * out) const;
+
+	const NameRecord & name(UserHandle u) const {
+		return names[slotOf(u)];
+	}
+	SessionCold & cold(UserHandle u) {
+		return colds[slotOf(u)];
+	}
+
+	// Liveness for keep-alive expiry.
+	void markSeen(UserHandle u) {
+		flags[slotOf(u)] |= SEEN;
+		missed[slotOf(u)] = 0;
+	}
+	bool takeSeen(UserHandle u) {
+		bool seen = flags[slotOf(u)] & SEEN;
+		flags[slotOf(u)] &= ~SEEN;
+		return seen;
+	}
+	int missedPeriods(UserHandle u) const {
+		return missed[slotOf(u)];
+	}
+	void missPeriod(UserHandle u) {
+		if(missed[slotOf(u)] < 255) {
+			++missed[slotOf(u)];
+		}
+	}
+
+	// Channel memberships, one list per user.
+	bool isMember(UserHandle u, const Channel * channel);
+	void addMembership(UserHandle u, Channel * channel);
+	bool removeMembership(UserHandle u, const Channel * channel);
+	// Removes every membership for which owned() is true, appending the
+	// channels to out.
+	void takeMemberships(UserHandle u, bool (*owned)(const Channel *), std::vector<Channel *> & out);
+
+	size_t size() const {
+		return live;
+	}
+	size_t capacity() const {
+		return cap;
+	}
+
+	// Bytes each slot costs once used, by kind, and per entry of the
+	// membership pool.
+	size_t hotBytesPerSlot() const;
+	size_t coldBytesPerSlot() const;
+	size_t indexBytesPerSlot() const;
+	static size_t bytesPerMembership();
+
+private:
+	enum { LINKED = 1, SEEN = 2 };
+
+	struct Membership {
+		Channel * channel;
+		uint32_t next;
+	};
+	static const int POOL_CHUNK_BITS = 12;
+	static const size_t POOL_CHUNK = 1 << POOL_CHUNK_BITS;
+	static const size_t POOL_MAX_CHUNKS = 1 << 16;
+	static const int LIST_LOCKS = 256;
+
+	size_t cap;
+	size_t highWater;		// Slots ever handed out
+	size_t live;
+
+	// Hot: per datagram
+	uint64_t * endpoints;	// Packed IPv4 address and port, or a tagged pointer
+	uint8_t * flags;
+	uint8_t * missed;		// Keep-alive periods in a row without a packet
+	uint32_t * memberships;	// Head of the user's list in the pool, 0 if none
+	uint8_t * generations;
+
+	// Cold
+	NameRecord * names;
+	SessionCold * colds;
+
+	// Free slots, oldest first, so a slot's generation comes round as
+	// rarely as possible.
+	uint32_t * freeSlots;
+	size_t freeHead;
+	size_t freeCount;
+	int freeLock;
+
+	// Open-addressed lookups of handles, by address and by token.
+	UserHandle * byAddress;
+	UserHandle * byToken;
+	size_t indexMask;
+
+	// Membership pool: fixed chunks, so entries never move either.
+	Membership * poolChunks[POOL_MAX_CHUNKS];
+	size_t poolChunksUsed;
+	uint32_t poolFree;		// Free list through next; 0 if empty
+	int poolLock;
+	int listLocks[LIST_LOCKS];
+
+	static size_t slotOf(UserHandle u) {
+		return u & ((1 << INDEX_BITS) - 1);
+	}
+	static uint8_t generationOf(UserHandle u) {
+		return u >> INDEX_BITS;
+	}
+	static UserHandle makeHandle(size_t slot, uint8_t generation) {
+		return ((UserHandle) generation << INDEX_BITS) | slot;
+	}
+
+	Membership & entry(uint32_t index) {
+		return poolChunks[index >> POOL_CHUNK_BITS][index & (POOL_CHUNK - 1)];
+	}
+	uint32_t newEntry(Channel * channel);
+	void freeEntry(uint32_t index);
+
+	uint64_t endpointFor(const struct sockaddr_storage * address) const;
+	bool sameAddress(size_t slot, const struct sockaddr_storage * address, uint64_t endpoint) const;
+	size_t addressHash(const struct sockaddr_storage * address, uint64_t endpoint) const;
+	void indexInsert(UserHandle * table, size_t hash, UserHandle u);
+	void indexRemove(UserHandle * table, UserHandle u, bool byAddr);
+	size_t hashOfSlot(size_t slot, bool byAddr) const;
+
+	static void lock(int * l);
+	static void unlock(int * l);
+
+	SessionStore(const SessionStore &);
+	SessionStore & operator=(const SessionStore &);
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+/*
+ *	spscqueue.h
+ *	Bounded lock-free single-producer/single-consumer ring, plus a way for an
+ *	idle consumer to sleep until the producer pushes something.
+ *
+ *	Exactly one thread may call push() and exactly one thread may call pop()
+ *	and wait().  The producer calls notify() after pushing; it only touches
+ *	the mutex when the consumer has announced that it is going to sleep.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+
+template <typename T>
+class SpscQueue {
+public:
+	// capacity is rounded up to a power of two.
+	SpscQueue(size_t capacity) : head(0), tail(0), sleeping(0) {
+		size = 1;
+		while(size < capacity) {
+			size <<= 1;
+		}
+		mask = size - 1;
+		slots = new T[size];
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&wake, NULL);
+	}
+
+	~SpscQueue() {
+		delete [] slots;
+		pthread_mutex_destroy(&lock);
+		pthread_cond_destroy(&wake);
+	}
+
+	// Producer side.  Returns false if the queue is full.
+	bool push(const T & item) {
+		size_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		if(t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) == size) {
+			return false;
+		}
+		slots[t & mask] = item;
+		__atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	// Producer side.  Wakes the consumer if it went to sleep in wait().
+	void notify() {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&sleeping, __ATOMIC_RELAXED)) {
+			pthread_mutex_lock(&lock);
+			pthread_cond_signal(&wake);
+			pthread_mutex_unlock(&lock);
+		}
+	}
+
+	// Consumer side.  Returns false if the queue is empty.
+	bool pop(T & item) {
+		size_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		if(h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+		item = slots[h & mask];
+		__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	// Consumer side.  Blocks until the queue is non-empty, spinning briefly
+	// first since bursts usually arrive back to back.
+	void wait() {
+		for(int i = 0; i < 64; ++i) {
+			if(!empty()) {
+				return;
+			}
+			sched_yield();
+		}
+		pthread_mutex_lock(&lock);
+		__atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while(empty()) {
+			pthread_cond_wait(&wake, &lock);
+		}
+		__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&lock);
+	}
+
+	bool empty() const {
+		return __atomic_load_n(&head, __ATOMIC_ACQUIRE) == __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+	}
+
+	// Either side.  Only a snapshot: the other side may be moving.
+	size_t depth() const {
+		return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	}
+
+	size_t capacity() const {
+		return size;
+	}
+
+private:
+	// Keep the producer and consumer indices on separate cache lines.
+	size_t head;
+	char pad1[64 - sizeof(size_t)];
+	size_t tail;
+	char pad2[64 - sizeof(size_t)];
+	int sleeping;
+	size_t size;
+	size_t mask;
+	T * slots;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	SpscQueue(const SpscQueue &);
+	SpscQueue & operator=(const SpscQueue &);
+};
+
+#endif
@@ -0,0 +1,333 @@
+/*
+ *	uringio.cpp
+ *	io_uring datagram I/O for the DuckChat server.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <iostream>
+
+#include "uringio.h"
+
+using namespace std;
+
+static const unsigned RING_ENTRIES = 1024;
+static const unsigned CQ_ENTRIES = 8192;
+static const unsigned RECV_BUFFERS = 512;		// Must be a power of two
+static const unsigned RECV_BUFFER_SIZE = 2048;
+static const unsigned short RECV_GROUP = 0;
+static const int SEND_SLOTS = 4096;
+static const unsigned long long RECV_TAG = ~0ULL;
+
+static inline unsigned loadAcquire(unsigned * p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void storeRelease(unsigned * p, unsigned v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+// Entry i of a buffer ring.  Not bufRing->bufs[i]: in C++ the kernel's
+// __DECLARE_FLEX_ARRAY puts an empty struct in front of bufs, moving it to
+// offset 8, while the kernel expects the entries to start at offset 0.
+static inline struct io_uring_buf * ringEntry(struct io_uring_buf_ring * ring, unsigned i) {
+	return (struct io_uring_buf *) ring + i;
+}
+
+UringSocket::UringSocket() : received(0), sent(0), sendFallbacks(0), enterCalls(0), kernelDrops(0),
+	sock(-1), ringFd(-1), pendingSubmit(0), sqRingMem(MAP_FAILED), cqRingMem(MAP_FAILED),
+	sqes((struct io_uring_sqe *) MAP_FAILED), bufRing((struct io_uring_buf_ring *) MAP_FAILED),
+	bufMem(NULL), bufTail(0), slots(NULL), freeSlot(-1) {}
+
+UringSocket::~UringSocket() {
+	if(sqes != MAP_FAILED) {
+		munmap(sqes, sqesSize);
+	}
+	if(cqRingMem != MAP_FAILED && cqRingMem != sqRingMem) {
+		munmap(cqRingMem, cqRingSize);
+	}
+	if(sqRingMem != MAP_FAILED) {
+		munmap(sqRingMem, sqRingSize);
+	}
+	if(bufRing != MAP_FAILED) {
+		munmap(bufRing, bufRingSize);
+	}
+	if(ringFd != -1) {
+		close(ringFd);
+	}
+	if(slots != NULL) {
+		for(int i = 0; i < SEND_SLOTS; ++i) {
+			free(slots[i].heapData);
+		}
+	}
+	delete [] slots;
+	free(bufMem);
+}
+
+bool UringSocket::init(int s) {
+	sock = s;
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = CQ_ENTRIES;
+	ringFd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if(ringFd == -1 && errno == EINVAL) {
+		// Older kernels don't know the scheduling hints.
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = CQ_ENTRIES;
+		ringFd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	}
+	if(ringFd == -1) {
+		perror("io_uring_setup");
+		return false;
+	}
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cqRingSize > sqRingSize) {
+			sqRingSize = cqRingSize;
+		}
+		cqRingSize = sqRingSize;
+	}
+	sqRingMem = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if(sqRingMem == MAP_FAILED) {
+		perror("mmap io_uring sq");
+		return false;
+	}
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		cqRingMem = sqRingMem;
+	} else {
+		cqRingMem = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		if(cqRingMem == MAP_FAILED) {
+			perror("mmap io_uring cq");
+			return false;
+		}
+	}
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED) {
+		perror("mmap io_uring sqes");
+		return false;
+	}
+
+	char * sq = (char *) sqRingMem;
+	sqHead = (unsigned *) (sq + params.sq_off.head);
+	sqTail = (unsigned *) (sq + params.sq_off.tail);
+	sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+	sqArray = (unsigned *) (sq + params.sq_off.array);
+	sqEntries = params.sq_entries;
+	char * cq = (char *) cqRingMem;
+	cqHead = (unsigned *) (cq + params.cq_off.head);
+	cqTail = (unsigned *) (cq + params.cq_off.tail);
+	cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	// Provided buffer ring for the multishot receive.
+	bufRingSize = RECV_BUFFERS * sizeof(struct io_uring_buf);
+	bufRing = (struct io_uring_buf_ring *) mmap(NULL, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(bufRing == MAP_FAILED) {
+		perror("mmap io_uring buffer ring");
+		return false;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) bufRing;
+	reg.ring_entries = RECV_BUFFERS;
+	reg.bgid = RECV_GROUP;
+	if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		perror("io_uring_register buffer ring");
+		return false;
+	}
+	bufMem = (char *) malloc(RECV_BUFFERS * RECV_BUFFER_SIZE);
+	for(unsigned i = 0; i < RECV_BUFFERS; ++i) {
+		struct io_uring_buf * b = ringEntry(bufRing, i);
+		b->addr = (unsigned long) (bufMem + i * RECV_BUFFER_SIZE);
+		b->len = RECV_BUFFER_SIZE;
+		b->bid = i;
+	}
+	bufTail = RECV_BUFFERS;
+	__atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+
+	slots = new SendSlot[SEND_SLOTS];
+	for(int i = 0; i < SEND_SLOTS; ++i) {
+		slots[i].heapData = NULL;
+		slots[i].nextFree = i + 1 < SEND_SLOTS ? i + 1 : -1;
+	}
+	freeSlot = 0;
+
+	memset(&recvMsg, 0, sizeof(recvMsg));
+	recvMsg.msg_namelen = sizeof(struct sockaddr_storage);
+	// Room for the SO_RXQ_OVFL drop count, which the kernel attaches when
+	// the server has enabled it on the socket.
+	recvMsg.msg_controllen = CMSG_SPACE(sizeof(uint32_t));
+	postRecv();
+	return true;
+}
+
+int UringSocket::enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	++enterCalls;
+	return syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+// Returns a free SQE, submitting what is already queued if the ring is full.
+struct io_uring_sqe * UringSocket::nextSqe() {
+	unsigned tail = *sqTail;
+	while(tail - loadAcquire(sqHead) >= sqEntries) {
+		int n = enter(pendingSubmit, 0, 0);
+		if(n > 0) {
+			pendingSubmit -= n;
+		}
+	}
+	struct io_uring_sqe * sqe = &sqes[tail & sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqArray[tail & sqMask] = tail & sqMask;
+	storeRelease(sqTail, tail + 1);
+	++pendingSubmit;
+	return sqe;
+}
+
+void UringSocket::postRecv() {
+	struct io_uring_sqe * sqe = nextSqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sock;
+	sqe->addr = (unsigned long) &recvMsg;
+	sqe->len = 0;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_GROUP;
+	sqe->user_data = RECV_TAG;
+}
+
+void UringSocket::recycleBuffer(unsigned short bid) {
+	struct io_uring_buf * b = ringEntry(bufRing, bufTail & (RECV_BUFFERS - 1));
+	b->addr = (unsigned long) (bufMem + bid * RECV_BUFFER_SIZE);
+	b->len = RECV_BUFFER_SIZE;
+	b->bid = bid;
+	++bufTail;
+	__atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+void UringSocket::releaseSlot(int index) {
+	SendSlot & slot = slots[index];
+	free(slot.heapData);
+	slot.heapData = NULL;
+	slot.nextFree = freeSlot;
+	freeSlot = index;
+}
+
+void UringSocket::send(const void * data, size_t len, const struct sockaddr * to, socklen_t toLen) {
+	if(freeSlot == -1) {
+		++sendFallbacks;
+		if(sendto(sock, data, len, 0, to, toLen) == -1) {
+			perror("while sending (io_uring fallback)");
+		}
+		return;
+	}
+	int index = freeSlot;
+	SendSlot & slot = slots[index];
+	freeSlot = slot.nextFree;
+
+	char * copy = slot.data;
+	if(len > sizeof(slot.data)) {
+		slot.heapData = (char *) malloc(len);
+		copy = slot.heapData;
+	}
+	memcpy(copy, data, len);
+	memcpy(&slot.address, to, toLen);
+	slot.iov.iov_base = copy;
+	slot.iov.iov_len = len;
+	memset(&slot.msg, 0, sizeof(slot.msg));
+	slot.msg.msg_name = &slot.address;
+	slot.msg.msg_namelen = toLen;
+	slot.msg.msg_iov = &slot.iov;
+	slot.msg.msg_iovlen = 1;
+
+	struct io_uring_sqe * sqe = nextSqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = sock;
+	sqe->addr = (unsigned long) &slot.msg;
+	sqe->len = 1;
+	sqe->user_data = index;
+}
+
+bool UringSocket::run(DatagramHandler handler) {
+	int n = enter(pendingSubmit, 1, IORING_ENTER_GETEVENTS);
+	if(n > 0) {
+		pendingSubmit -= n;
+	} else if(n == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		perror("io_uring_enter");
+	}
+
+	unsigned head = *cqHead;
+	unsigned tail = loadAcquire(cqTail);
+	if(head == tail) {
+		return false;
+	}
+	for(; head != tail; ++head) {
+		struct io_uring_cqe * cqe = &cqes[head & cqMask];
+		if(cqe->user_data != RECV_TAG) {
+			if(cqe->res < 0) {
+				errno = -cqe->res;
+				perror("while sending (io_uring)");
+			} else {
+				++sent;
+			}
+			releaseSlot((int) cqe->user_data);
+			continue;
+		}
+
+		if(!(cqe->flags & IORING_CQE_F_MORE)) {
+			// The kernel ended the multishot (e.g. out of buffers); re-arm.
+			postRecv();
+		}
+		if(cqe->res < 0) {
+			if(cqe->res != -ENOBUFS) {
+				errno = -cqe->res;
+				perror("while receiving (io_uring)");
+			}
+			continue;
+		}
+		if(!(cqe->flags & IORING_CQE_F_BUFFER)) {
+			continue;
+		}
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		char * buf = bufMem + bid * RECV_BUFFER_SIZE;
+		struct io_uring_recvmsg_out * out = (struct io_uring_recvmsg_out *) buf;
+		char * name = buf + sizeof(*out);
+		char * payload = name + recvMsg.msg_namelen + recvMsg.msg_controllen;
+		struct msghdr control;
+		memset(&control, 0, sizeof(control));
+		control.msg_control = name + recvMsg.msg_namelen;
+		control.msg_controllen = out->controllen;
+		for(struct cmsghdr * c = CMSG_FIRSTHDR(&control); c != NULL; c = CMSG_NXTHDR(&control, c)) {
+#ifdef SO_RXQ_OVFL
+			if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+				uint32_t drops;
+				memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+				kernelDrops = drops;
+			}
+#endif
+		}
+		if(!(out->flags & MSG_TRUNC) || out->payloadlen > 0) {
+			struct sockaddr_storage from;
+			memset(&from, 0, sizeof(from));
+			memcpy(&from, name, out->namelen < sizeof(from) ? out->namelen : sizeof(from));
+			size_t room = RECV_BUFFER_SIZE - (payload - buf);
+			int len = out->payloadlen < room ? out->payloadlen : room;
+			++received;
+			handler(payload, len, &from);
+		}
+		recycleBuffer(bid);
+	}
+	storeRelease(cqHead, head);
+	return true;
+}
@@ -0,0 +1,109 @@
+#ifndef URINGIO_H
+#define URINGIO_H
+
+/*
+ *	uringio.h
+ *	io_uring datagram I/O for the DuckChat server, written against the raw
+ *	kernel interface so it has no library dependency.
+ *
+ *	A single multishot RECVMSG stays posted on the socket and picks its
+ *	buffers from a registered buffer ring, so receiving costs no syscall per
+ *	datagram.  Sends are queued as SENDMSG entries and go to the kernel
+ *	together with the next wait for completions, so a whole fan-out is
+ *	submitted with one io_uring_enter.
+ *
+ *	Only one thread may use a UringSocket.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Kept out of this header: duckchat.h's "packed" macro breaks the kernel's.
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+class UringSocket {
+public:
+	typedef void (*DatagramHandler)(char * data, int len, struct sockaddr_storage * from);
+
+	UringSocket();
+	~UringSocket();
+
+	// Sets up the ring on an already bound socket.  Returns false (after
+	// printing why) if the kernel can't do it; the caller should fall back
+	// to recvfrom/sendto.
+	bool init(int sock);
+
+	// Submits queued sends, waits for at least one completion and passes
+	// every received datagram to handler.  Returns false if interrupted by
+	// a signal before anything completed.
+	bool run(DatagramHandler handler);
+
+	// Copies the datagram and queues it for sending.  Falls back to a plain
+	// sendto when every send slot is still in flight.
+	void send(const void * data, size_t len, const struct sockaddr * to, socklen_t toLen);
+
+	unsigned long received;
+	unsigned long sent;
+	unsigned long sendFallbacks;
+	unsigned long enterCalls;
+	unsigned long kernelDrops;	// Socket's SO_RXQ_OVFL count, if enabled
+
+private:
+	struct SendSlot {
+		struct msghdr msg;
+		struct iovec iov;
+		struct sockaddr_storage address;
+		char data[2048];
+		char * heapData;
+		int nextFree;
+	};
+
+	int sock;
+	int ringFd;
+
+	// Submission queue
+	unsigned * sqHead;
+	unsigned * sqTail;
+	unsigned sqMask;
+	unsigned * sqArray;
+	struct io_uring_sqe * sqes;
+	unsigned sqEntries;
+	unsigned pendingSubmit;
+
+	// Completion queue
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe * cqes;
+
+	void * sqRingMem;
+	size_t sqRingSize;
+	void * cqRingMem;
+	size_t cqRingSize;
+	size_t sqesSize;
+
+	// Registered receive buffers
+	struct io_uring_buf_ring * bufRing;
+	size_t bufRingSize;
+	char * bufMem;
+	unsigned short bufTail;
+	struct msghdr recvMsg;
+
+	SendSlot * slots;
+	int freeSlot;
+
+	struct io_uring_sqe * nextSqe();
+	int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+	void postRecv();
+	void recycleBuffer(unsigned short bid);
+	void releaseSlot(int index);
+
+	UringSocket(const UringSocket &);
+	UringSocket & operator=(const UringSocket &);
+};
+
+#endif